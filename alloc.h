@@ -0,0 +1,74 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+#include "phase.h"
+
+// Heap allocation accounting. The counters are fed by the allocation hooks that
+// the benchmark executable installs (operator new, and malloc on glibc, which
+// is where Eigen's temporaries come from). Without the hooks they stay at zero.
+
+// Totals of every counted allocation since the start of the process
+struct alloc_counts_t
+{
+	uint64_t allocations;
+	uint64_t bytes;
+};
+
+inline std::atomic<uint64_t> alloc_allocations{0};
+inline std::atomic<uint64_t> alloc_bytes{0};
+
+// When set, allocating inside a no_alloc_scope_t aborts the process
+inline std::atomic<bool> alloc_strict{false};
+
+// True while the calling thread is inside a no_alloc_scope_t
+inline thread_local bool alloc_forbidden = false;
+
+inline alloc_counts_t alloc_counts()
+{
+	return { alloc_allocations.load(std::memory_order_relaxed), alloc_bytes.load(std::memory_order_relaxed) };
+}
+
+// Called by the allocation hooks for every allocation of bytes
+inline void count_allocation(size_t bytes)
+{
+	alloc_allocations.fetch_add(1, std::memory_order_relaxed);
+	alloc_bytes.fetch_add(bytes, std::memory_order_relaxed);
+	if (alloc_forbidden && alloc_strict.load(std::memory_order_relaxed))
+	{
+		// Formatting a message could allocate again, so write a fixed one
+		static const char message[] = "heap allocation in a steady-state loop\n";
+		std::fwrite(message, 1, sizeof(message) - 1, stderr);
+		std::abort();
+	}
+}
+
+// Marks the steady-state loop of an engine, which must not allocate. Strict mode
+// is enforced only by the per-thread check in count_allocation, never through
+// Eigen's runtime malloc switch: that one is process-wide, so one thread's scope
+// would forbid allocations on threads that are still seeding. Without the glibc
+// malloc hook only operator new is checked.
+class no_alloc_scope_t
+{
+	bool was_forbidden_;
+
+public:
+	no_alloc_scope_t()
+		:
+	was_forbidden_(alloc_forbidden)
+	{
+		// Thread-local timer state allocates on first use, so set it up first
+		phase_thread_init();
+		alloc_forbidden = true;
+	}
+
+	no_alloc_scope_t(const no_alloc_scope_t&) = delete;
+	no_alloc_scope_t& operator=(const no_alloc_scope_t&) = delete;
+
+	~no_alloc_scope_t()
+	{
+		alloc_forbidden = was_forbidden_;
+	}
+};
@@ -0,0 +1,266 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "eigen/Core"
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+// Timing samples of one benchmark, in ns per combination
+struct benchmark_result_t
+{
+	std::string name;
+	std::vector<double> samples;
+};
+
+// A benchmark run tagged with where it ran, so baselines from different
+// hosts, compilers or Eigen versions can be told apart.
+struct benchmark_results_t
+{
+	std::string host;
+	std::string compiler;
+	std::string cpu;
+	std::string eigen;
+	std::vector<benchmark_result_t> benchmarks;
+};
+
+inline std::string host_name()
+{
+#ifdef __linux__
+	char name[256] = {};
+	if (gethostname(name, sizeof(name) - 1) == 0)
+	{
+		return name;
+	}
+#endif
+	return "unknown";
+}
+
+inline std::string compiler_name()
+{
+#if defined(__clang__)
+	return std::string("clang ") + __clang_version__;
+#elif defined(__GNUC__)
+	return std::string("gcc ") + __VERSION__;
+#elif defined(_MSC_VER)
+	return "msvc " + std::to_string(_MSC_FULL_VER);
+#else
+	return "unknown";
+#endif
+}
+
+inline std::string cpu_name()
+{
+	std::ifstream cpuinfo("/proc/cpuinfo");
+	std::string line;
+	while (std::getline(cpuinfo, line))
+	{
+		if (line.compare(0, 10, "model name") == 0)
+		{
+			auto colon = line.find(':');
+			if (colon != std::string::npos && colon + 2 <= line.size())
+			{
+				return line.substr(colon + 2);
+			}
+		}
+	}
+	return "unknown";
+}
+
+// Results with the tags of the running process filled in
+inline benchmark_results_t current_results()
+{
+	benchmark_results_t results;
+	results.host = host_name();
+	results.compiler = compiler_name();
+	results.cpu = cpu_name();
+	results.eigen = std::to_string(EIGEN_WORLD_VERSION) + "." + std::to_string(EIGEN_MAJOR_VERSION) + "." + std::to_string(EIGEN_MINOR_VERSION);
+	return results;
+}
+
+// Write results as text: one "tag value" line per tag, then one line per benchmark
+// with its name followed by its samples.
+inline void save_results(const std::string& path, const benchmark_results_t& results)
+{
+	std::ofstream out(path);
+	if (!out)
+	{
+		throw std::runtime_error("cannot write results " + path);
+	}
+	out << "host " << results.host << "\n";
+	out << "compiler " << results.compiler << "\n";
+	out << "cpu " << results.cpu << "\n";
+	out << "eigen " << results.eigen << "\n";
+	out << std::setprecision(17);
+	for (const auto& benchmark : results.benchmarks)
+	{
+		out << "benchmark " << benchmark.name;
+		for (auto sample : benchmark.samples)
+		{
+			out << " " << sample;
+		}
+		out << "\n";
+	}
+}
+
+inline benchmark_results_t load_results(const std::string& path)
+{
+	std::ifstream in(path);
+	if (!in)
+	{
+		throw std::runtime_error("cannot read results " + path);
+	}
+	benchmark_results_t results;
+	std::string line;
+	while (std::getline(in, line))
+	{
+		auto space = line.find(' ');
+		auto tag = line.substr(0, space);
+		auto value = space == std::string::npos ? std::string() : line.substr(space + 1);
+		if (tag == "host")
+		{
+			results.host = value;
+		}
+		else if (tag == "compiler")
+		{
+			results.compiler = value;
+		}
+		else if (tag == "cpu")
+		{
+			results.cpu = value;
+		}
+		else if (tag == "eigen")
+		{
+			results.eigen = value;
+		}
+		else if (tag == "benchmark")
+		{
+			std::istringstream fields(value);
+			benchmark_result_t benchmark;
+			fields >> benchmark.name;
+			for (double sample; fields >> sample;)
+			{
+				benchmark.samples.push_back(sample);
+			}
+			results.benchmarks.push_back(benchmark);
+		}
+	}
+	return results;
+}
+
+inline double median(std::vector<double> samples)
+{
+	if (samples.empty())
+	{
+		return 0;
+	}
+	std::sort(samples.begin(), samples.end());
+	auto n = samples.size();
+	return n % 2 ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+}
+
+// One-sided Mann-Whitney U test that samples b tend to be larger than samples a,
+// using the normal approximation with tie correction. Returns the p-value.
+inline double mann_whitney_p(const std::vector<double>& a, const std::vector<double>& b)
+{
+	if (a.empty() || b.empty())
+	{
+		return 1;
+	}
+
+	// Count pairs where b exceeds a, ties counting half
+	double u = 0;
+	for (auto x : a)
+	{
+		for (auto y : b)
+		{
+			u += y > x ? 1 : y == x ? 0.5 : 0;
+		}
+	}
+
+	std::vector<double> all(a);
+	all.insert(all.end(), b.begin(), b.end());
+	std::sort(all.begin(), all.end());
+	double ties = 0;
+	for (size_t i = 0; i < all.size();)
+	{
+		auto j = i;
+		while (j < all.size() && all[j] == all[i])
+		{
+			++j;
+		}
+		double t = static_cast<double>(j - i);
+		ties += t * t * t - t;
+		i = j;
+	}
+
+	double n1 = static_cast<double>(a.size());
+	double n2 = static_cast<double>(b.size());
+	double n = n1 + n2;
+	double mean = n1 * n2 / 2;
+	double variance = n1 * n2 / 12 * ((n + 1) - ties / (n * (n - 1)));
+	if (variance <= 0)
+	{
+		return 1;
+	}
+	auto z = (u - mean - 0.5) / std::sqrt(variance);
+	return 0.5 * std::erfc(z / std::sqrt(2.0));
+}
+
+// Fewest samples per side for which mann_whitney_p can reach 0.05; with fewer
+// every regression would pass as not significant
+const size_t min_compare_samples = 3;
+
+// Compare current results against a baseline, printing one line per benchmark.
+// A benchmark regresses when its median is more than threshold (a fraction) slower
+// and the samples show it is slower at significance alpha. Returns the number of
+// regressions, counting benchmarks missing from the current run and those with
+// too few samples on either side to test, which are reported as inconclusive.
+inline int compare_results(const benchmark_results_t& baseline, const benchmark_results_t& current, double threshold, std::ostream& out, double alpha = 0.05)
+{
+	if (baseline.host != current.host || baseline.compiler != current.compiler || baseline.cpu != current.cpu || baseline.eigen != current.eigen)
+	{
+		out << "baseline is from " << baseline.host << ", " << baseline.compiler << ", " << baseline.cpu << ", Eigen " << baseline.eigen << std::endl;
+	}
+
+	auto regressions = 0;
+	for (const auto& base : baseline.benchmarks)
+	{
+		auto found = std::find_if(current.benchmarks.begin(), current.benchmarks.end(),
+			[&](const benchmark_result_t& b) { return b.name == base.name; });
+		out << std::left << std::setw(30) << base.name;
+		if (found == current.benchmarks.end())
+		{
+			out << "missing" << std::endl;
+			++regressions;
+			continue;
+		}
+		if (base.samples.size() < min_compare_samples || found->samples.size() < min_compare_samples)
+		{
+			out << "inconclusive, " << base.samples.size() << " baseline and " << found->samples.size() << " current samples, need " << min_compare_samples << std::endl;
+			++regressions;
+			continue;
+		}
+		auto change = median(found->samples) / median(base.samples) - 1;
+		auto p = mann_whitney_p(base.samples, found->samples);
+		auto regressed = change > threshold && p < alpha;
+		std::ostringstream line;
+		line << std::showpos << std::fixed << std::setprecision(1) << change * 100 << "%" << std::noshowpos
+			<< std::defaultfloat << std::setprecision(3) << " (p=" << p << ")";
+		if (regressed)
+		{
+			line << " REGRESSION";
+			++regressions;
+		}
+		out << line.str() << std::endl;
+	}
+	return regressions;
+}
@@ -1,6 +1,17 @@
 #pragma once
 #include <functional>
 #include <chrono>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 // Time the execution of f for the given number of iterations
 inline std::chrono::duration<double> time_func(std::function<bool()> f, int iterations)
@@ -15,9 +26,208 @@ inline std::chrono::duration<double> time_func(std::function<bool()> f, int iter
 	return end - start;
 }
 
-// Represents a named benchmark with a function returning a success flag
+// Represents a named benchmark with a function returning a success flag.
+// batch is the number of main matrices processed by each call of func, counting
+// each ridge parameter of the ridge benchmarks as one.
 struct benchmark_t
 {
 	const char* name;
 	std::function<bool()> func;
-};
\ No newline at end of file
+	int batch = 1;
+};
+
+// Hardware events that perf_counters_t can count
+enum perf_event_t
+{
+	perf_cycles,
+	perf_instructions,
+	perf_l1d_misses,
+	perf_llc_misses,
+	perf_branch_misses,
+	perf_event_count
+};
+
+inline const char* perf_event_name(int event)
+{
+	static const char* names[] = { "cycles", "instructions", "l1d-misses", "llc-misses", "branch-misses" };
+	return names[event];
+}
+
+// Event totals summed over every counted thread. An event is missing if it could
+// not be opened on any thread, e.g. because the PMU is virtualised away.
+struct perf_counts_t
+{
+	std::array<uint64_t, perf_event_count> counts{};
+	std::array<bool, perf_event_count> valid{};
+};
+
+// Thread ids of the calling thread and of every OpenMP worker, which persist
+// between parallel regions so counters opened on them follow later benchmarks.
+// Threads started outside the OpenMP pool, such as a stream's producer, a
+// result writer or service workers, are not among them and go uncounted.
+inline std::vector<int> benchmark_thread_ids()
+{
+	std::vector<int> ids;
+#ifdef __linux__
+	ids.push_back(static_cast<int>(syscall(SYS_gettid)));
+	#pragma omp parallel
+	{
+		auto id = static_cast<int>(syscall(SYS_gettid));
+		#pragma omp critical
+		{
+			if (id != ids.front())
+			{
+				ids.push_back(id);
+			}
+		}
+	}
+#endif
+	return ids;
+}
+
+// Linux perf_event_open counters on a set of threads. Opening fails quietly when
+// perf events are not permitted; available() then reports false and counts are
+// all marked invalid, so callers can report without special cases. When more
+// events are open than the PMU has counters the kernel multiplexes them, and
+// each count is scaled up by the fraction of the time its event was running.
+class perf_counters_t
+{
+	// fds_[thread * perf_event_count + event], -1 where the event could not be opened
+	std::vector<int> fds_;
+
+	// Value, time enabled and time running as read with the read_format below
+	struct reading_t
+	{
+		uint64_t value;
+		uint64_t enabled;
+		uint64_t running;
+	};
+
+	// Times at the last start, as a reset does not clear them
+	std::vector<reading_t> started_;
+
+	bool read_fd(size_t i, reading_t& reading) const
+	{
+#ifdef __linux__
+		return fds_[i] >= 0 && ::read(fds_[i], &reading, sizeof(reading)) == sizeof(reading);
+#else
+		return false;
+#endif
+	}
+
+public:
+	explicit perf_counters_t(const std::vector<int>& thread_ids)
+		:
+	fds_(thread_ids.size() * perf_event_count, -1),
+	started_(fds_.size(), reading_t{})
+	{
+#ifdef __linux__
+		static const uint64_t configs[][2] = {
+			{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+			{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+			{ PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+			{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+			{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+		};
+		for (size_t thread = 0; thread < thread_ids.size(); ++thread)
+		{
+			for (int event = 0; event < perf_event_count; ++event)
+			{
+				perf_event_attr attr;
+				std::memset(&attr, 0, sizeof(attr));
+				attr.size = sizeof(attr);
+				attr.type = static_cast<uint32_t>(configs[event][0]);
+				attr.config = configs[event][1];
+				attr.disabled = 1;
+				attr.exclude_kernel = 1;
+				attr.exclude_hv = 1;
+				attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+				fds_[thread * perf_event_count + event] = static_cast<int>(syscall(SYS_perf_event_open, &attr, thread_ids[thread], -1, -1, 0));
+			}
+		}
+#endif
+	}
+
+	perf_counters_t(const perf_counters_t&) = delete;
+	perf_counters_t& operator=(const perf_counters_t&) = delete;
+
+	~perf_counters_t()
+	{
+#ifdef __linux__
+		for (auto fd : fds_)
+		{
+			if (fd >= 0)
+			{
+				close(fd);
+			}
+		}
+#endif
+	}
+
+	// True if at least one event could be opened
+	bool available() const
+	{
+		for (auto fd : fds_)
+		{
+			if (fd >= 0)
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Reset and enable every counter
+	void start()
+	{
+#ifdef __linux__
+		for (size_t i = 0; i < fds_.size(); ++i)
+		{
+			if (fds_[i] >= 0)
+			{
+				ioctl(fds_[i], PERF_EVENT_IOC_RESET, 0);
+				read_fd(i, started_[i]);
+				ioctl(fds_[i], PERF_EVENT_IOC_ENABLE, 0);
+			}
+		}
+#endif
+	}
+
+	void stop()
+	{
+#ifdef __linux__
+		for (auto fd : fds_)
+		{
+			if (fd >= 0)
+			{
+				ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+			}
+		}
+#endif
+	}
+
+	// Totals over all threads since the last start, scaled for multiplexing. A
+	// thread on which an event never got onto the PMU adds nothing to it.
+	perf_counts_t read() const
+	{
+		perf_counts_t counts;
+		for (size_t i = 0; i < fds_.size(); ++i)
+		{
+			reading_t reading;
+			if (!read_fd(i, reading))
+			{
+				continue;
+			}
+			auto enabled = reading.enabled - started_[i].enabled;
+			auto running = reading.running - started_[i].running;
+			auto value = static_cast<double>(reading.value);
+			if (running > 0 && running < enabled)
+			{
+				value *= static_cast<double>(enabled) / running;
+			}
+			counts.counts[i % perf_event_count] += static_cast<uint64_t>(value);
+			counts.valid[i % perf_event_count] = true;
+		}
+		return counts;
+	}
+};
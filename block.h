@@ -0,0 +1,460 @@
+#pragma once
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+#include "eigen/Dense"
+
+#include "matrix.h"
+#include "schedule.h"
+
+// Block-structured enumeration. The last group of a schedule changes fastest and
+// replays its sequence for every state of the groups outside it, so the block of
+// the combination it selects repeats many times. Its slots are the leading ones
+// of the combination, as it owns the lowest item indices, so a combination is
+//   A = [K B; C D]
+// with K the last group's block, and by the Schur complement S = D - C K^-1 B
+//   A^-1 = [K^-1 + K^-1 B S^-1 C K^-1, -K^-1 B S^-1; -S^-1 C K^-1, S^-1].
+// K^-1 depends only on which items of the group are selected, so it is kept in a
+// block_cache_t and each distinct one is inverted once.
+//
+// That still leaves the r x r complement S to factor at every step, for r items
+// outside the last group. When r is the larger, the engine pivots on D instead,
+// which only changes once the last group has run through its sequence: with
+// G the last group's items, D^-1, A[G, rest] D^-1, D^-1 A[rest, G] and their
+// product M are formed once per pass, and each step inverts the p x p
+// complement S' = K - M[sel, sel] of the p selected items,
+//   A^-1 = [S'^-1, -S'^-1 B D^-1; -D^-1 C S'^-1, D^-1 + D^-1 C S'^-1 B D^-1].
+
+// Inverse of the block a group-local selection picks out of the main matrix
+struct block_inverse_t
+{
+	Eigen::MatrixXd inverse;
+	bool singular;
+};
+
+struct block_cache_stats_t
+{
+	int64_t hits = 0;
+	int64_t misses = 0;
+	int64_t evictions = 0;
+	int64_t entries = 0;
+	size_t bytes = 0;
+};
+
+// Block inverses by selection mask, least recently used first out once they
+// take more than max_bytes. A cache serves one main matrix and may be shared by
+// any number of threads enumerating it; entries are handed out as shared
+// pointers, so eviction never invalidates one in use. Masks are spread over
+// shards with a lock, LRU order and max_bytes / shards each, so threads only
+// contend when they look up masks of the same shard at once.
+class block_cache_t
+{
+	typedef std::shared_ptr<const block_inverse_t> value_t;
+	typedef std::list<std::pair<uint64_t, value_t>> lru_t;
+
+	static const int shard_bits = 4;
+	static const int shard_count = 1 << shard_bits;
+
+	struct shard_t
+	{
+		std::mutex mutex;
+		lru_t lru;
+		std::unordered_map<uint64_t, lru_t::iterator> entries;
+		block_cache_stats_t stats;
+	};
+
+	size_t max_bytes_;
+	shard_t shards_[shard_count];
+
+	static size_t bytes_of(const block_inverse_t& block)
+	{
+		return sizeof(block_inverse_t) + block.inverse.size() * sizeof(double);
+	}
+
+	// Fibonacci hashing, as masks of one group differ only in a few low bits
+	shard_t& shard_of(uint64_t mask)
+	{
+		return shards_[(mask * 0x9E3779B97F4A7C15ull) >> (64 - shard_bits)];
+	}
+
+public:
+	explicit block_cache_t(size_t max_bytes = size_t(64) << 20)
+		:
+	max_bytes_(max_bytes / shard_count)
+	{
+	}
+
+	block_cache_t(const block_cache_t&) = delete;
+	block_cache_t& operator=(const block_cache_t&) = delete;
+
+	// The block inverse for mask, computed by invert() on a miss. invert runs
+	// outside the lock, so threads missing on the same mask may both compute it.
+	template<class Invert>
+	value_t get(uint64_t mask, Invert&& invert)
+	{
+		auto& shard = shard_of(mask);
+		{
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			auto found = shard.entries.find(mask);
+			if (found != shard.entries.end())
+			{
+				++shard.stats.hits;
+				shard.lru.splice(shard.lru.begin(), shard.lru, found->second);
+				return found->second->second;
+			}
+			++shard.stats.misses;
+		}
+
+		value_t value = std::make_shared<const block_inverse_t>(invert());
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		auto found = shard.entries.find(mask);
+		if (found != shard.entries.end())
+		{
+			return found->second->second;
+		}
+		shard.lru.emplace_front(mask, value);
+		shard.entries[mask] = shard.lru.begin();
+		shard.stats.bytes += bytes_of(*value);
+		while (shard.stats.bytes > max_bytes_ && !shard.lru.empty())
+		{
+			shard.stats.bytes -= bytes_of(*shard.lru.back().second);
+			shard.entries.erase(shard.lru.back().first);
+			shard.lru.pop_back();
+			++shard.stats.evictions;
+		}
+		return value;
+	}
+
+	block_cache_stats_t stats()
+	{
+		block_cache_stats_t stats;
+		for (auto& shard : shards_)
+		{
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			stats.hits += shard.stats.hits;
+			stats.misses += shard.stats.misses;
+			stats.evictions += shard.stats.evictions;
+			stats.entries += static_cast<int64_t>(shard.entries.size());
+			stats.bytes += shard.stats.bytes;
+		}
+		return stats;
+	}
+
+	void clear()
+	{
+		for (auto& shard : shards_)
+		{
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			shard.lru.clear();
+			shard.entries.clear();
+			shard.stats.bytes = 0;
+		}
+	}
+};
+
+// Enumerates a schedule computing every inverse by the block forms above. If
+// p items come from the last group, of g, and r from the others, a step costs
+// O(p^2 r + r^3) pivoting on K, with the block inverses from a block_cache_t,
+// or O(p r^2 + p^3) pivoting on D, plus O(r^3 + g r^2 + g^2 r) once per pass
+// of the last group, against O(k^3) for direct_engine_t. The engine pivots on
+// D when r > p, where the cache goes unused. Where the pivot block or its
+// complement is singular the combination is inverted directly. The last group
+// may have at most 64 items.
+class block_engine_t
+{
+	main_matrix_t main_;
+	const schedule_t& schedule_;
+	int64_t rank_ = 0;
+	std::vector<int> comb_to_main_;
+	std::unique_ptr<block_cache_t> own_cache_;
+	block_cache_t* cache_;
+
+	// Items of the last group's block and of the rest, and the block's mask
+	int block_size_;
+	std::vector<int> block_items_;
+	std::vector<int> rest_items_;
+	uint64_t mask_ = 0;
+	std::shared_ptr<const block_inverse_t> block_;
+
+	// Pivoting on D: the last group's items, and D^-1, A[G, rest] D^-1,
+	// D^-1 A[rest, G] and M for the current rest, unless it is singular
+	bool rest_pivot_;
+	std::vector<int> group_items_;
+	Eigen::PartialPivLU<Eigen::MatrixXd> rest_lu_;
+	Eigen::MatrixXd rest_inverse_;
+	Eigen::MatrixXd group_b_;
+	Eigen::MatrixXd group_c_;
+	Eigen::MatrixXd group_m_;
+	bool rest_singular_ = false;
+
+	// Off-diagonal blocks, K^-1 B, C K^-1 and the Schur complement, or pivoting
+	// on D, the selected rows of A[G, rest] D^-1 and columns of D^-1 A[rest, G]
+	// and S'
+	Eigen::MatrixXd b_;
+	Eigen::MatrixXd c_;
+	Eigen::MatrixXd w_;
+	Eigen::MatrixXd z_;
+	Eigen::MatrixXd schur_;
+	Eigen::PartialPivLU<Eigen::MatrixXd> lu_;
+	Eigen::MatrixXd inverse_;
+	bool singular_ = false;
+	int64_t direct_ = 0;
+
+	void fetch_block()
+	{
+		block_ = cache_->get(mask_, [&]()
+		{
+			Eigen::PartialPivLU<Eigen::MatrixXd> lu(indexed_view(main_, block_items_, block_items_));
+			block_inverse_t block;
+			block.inverse.resize(block_size_, block_size_);
+			block.singular = !lu_inverse(lu, block.inverse);
+			return block;
+		});
+	}
+
+	void invert_directly()
+	{
+		++direct_;
+		lu_.compute(indexed_view(main_, comb_to_main_, comb_to_main_));
+		singular_ = !lu_inverse(lu_, inverse_);
+	}
+
+	// The pieces of the D pivot for the current rest
+	void factor_rest()
+	{
+		rest_lu_.compute(indexed_view(main_, rest_items_, rest_items_));
+		rest_singular_ = !lu_inverse(rest_lu_, rest_inverse_);
+		if (rest_singular_)
+		{
+			return;
+		}
+		group_b_.noalias() = indexed_view(main_, group_items_, rest_items_) * rest_inverse_;
+		group_c_.noalias() = rest_inverse_ * indexed_view(main_, rest_items_, group_items_);
+		group_m_.noalias() = indexed_view(main_, group_items_, rest_items_) * group_c_;
+	}
+
+	void invert_by_rest()
+	{
+		auto p = block_size_;
+		auto r = comb_size() - p;
+		if (rest_singular_)
+		{
+			invert_directly();
+			return;
+		}
+
+		// S' into the top left, then its inverse
+		auto top_left = inverse_.topLeftCorner(p, p);
+		auto top_right = inverse_.topRightCorner(p, r);
+		auto bottom_left = inverse_.bottomLeftCorner(r, p);
+		auto bottom_right = inverse_.bottomRightCorner(r, r);
+		for (int i = 0; i < p; ++i)
+		{
+			w_.row(i) = group_b_.row(block_items_[i]);
+			z_.col(i) = group_c_.col(block_items_[i]);
+			for (int j = 0; j < p; ++j)
+			{
+				schur_(i, j) = main_(block_items_[i], block_items_[j]) - group_m_(block_items_[i], block_items_[j]);
+			}
+		}
+		lu_.compute(schur_);
+		if (!lu_inverse(lu_, top_left))
+		{
+			invert_directly();
+			return;
+		}
+		top_right.noalias() = top_left * w_;
+		top_right *= -1;
+		bottom_left.noalias() = z_ * top_left;
+		bottom_left *= -1;
+		bottom_right = rest_inverse_;
+		bottom_right.noalias() -= bottom_left * w_;
+		singular_ = !inverse_.allFinite();
+	}
+
+	void invert()
+	{
+		if (rest_pivot_)
+		{
+			invert_by_rest();
+			return;
+		}
+		auto p = block_size_;
+		auto r = comb_size() - p;
+		if (block_->singular)
+		{
+			invert_directly();
+			return;
+		}
+		const auto& k_inverse = block_->inverse;
+		if (r == 0)
+		{
+			inverse_ = k_inverse;
+			singular_ = false;
+			return;
+		}
+
+		b_ = indexed_view(main_, block_items_, rest_items_);
+		c_ = indexed_view(main_, rest_items_, block_items_);
+		w_.noalias() = k_inverse * b_;
+		z_.noalias() = c_ * k_inverse;
+		schur_ = indexed_view(main_, rest_items_, rest_items_);
+		schur_.noalias() -= c_ * w_;
+		lu_.compute(schur_);
+		auto top_left = inverse_.topLeftCorner(p, p);
+		auto top_right = inverse_.topRightCorner(p, r);
+		auto bottom_left = inverse_.bottomLeftCorner(r, p);
+		auto bottom_right = inverse_.bottomRightCorner(r, r);
+		if (!lu_inverse(lu_, bottom_right))
+		{
+			invert_directly();
+			return;
+		}
+		top_right.noalias() = w_ * bottom_right;
+		top_right *= -1;
+		bottom_left.noalias() = bottom_right * z_;
+		bottom_left *= -1;
+		top_left = k_inverse;
+		top_left.noalias() -= top_right * z_;
+		singular_ = !inverse_.allFinite();
+	}
+
+public:
+	// Block inverses and misses allocate
+	static const bool allocates_in_step = true;
+
+	// With a cache of its own
+	block_engine_t(const main_matrix_t& main, const schedule_t& schedule)
+		:
+	block_engine_t(main, schedule, nullptr)
+	{
+		own_cache_.reset(new block_cache_t());
+		cache_ = own_cache_.get();
+	}
+
+	// With cache, which must outlive the engine and only serve main
+	block_engine_t(const main_matrix_t& main, const schedule_t& schedule, block_cache_t& cache)
+		:
+	block_engine_t(main, schedule, &cache)
+	{
+	}
+
+	void seed(int64_t rank)
+	{
+		rank_ = rank;
+		comb_to_main_ = schedule_.selection_at(rank);
+		auto n = comb_size();
+		block_items_.assign(comb_to_main_.begin(), comb_to_main_.begin() + block_size_);
+		rest_items_.assign(comb_to_main_.begin() + block_size_, comb_to_main_.end());
+		mask_ = 0;
+		for (auto item : block_items_)
+		{
+			mask_ |= uint64_t(1) << item;
+		}
+		inverse_.resize(n, n);
+		if (rest_pivot_)
+		{
+			auto g = static_cast<int>(group_items_.size());
+			auto r = n - block_size_;
+			rest_inverse_.resize(r, r);
+			group_b_.resize(g, r);
+			group_c_.resize(r, g);
+			group_m_.resize(g, g);
+			w_.resize(block_size_, r);
+			z_.resize(r, block_size_);
+			schur_.resize(block_size_, block_size_);
+			factor_rest();
+		}
+		else
+		{
+			fetch_block();
+		}
+		invert();
+	}
+
+	void step()
+	{
+		const auto& swap = schedule_[rank_];
+		++rank_;
+		comb_to_main_[swap.slot] = swap.added;
+		if (swap.slot < block_size_)
+		{
+			block_items_[swap.slot] = swap.added;
+			mask_ ^= (uint64_t(1) << swap.removed) | (uint64_t(1) << swap.added);
+			if (!rest_pivot_)
+			{
+				fetch_block();
+			}
+		}
+		else
+		{
+			rest_items_[swap.slot - block_size_] = swap.added;
+			if (rest_pivot_)
+			{
+				factor_rest();
+			}
+		}
+		invert();
+	}
+
+	bool singular() const
+	{
+		return singular_;
+	}
+
+	// Combinations inverted directly because a block was singular
+	int64_t direct() const
+	{
+		return direct_;
+	}
+
+	block_cache_t& cache()
+	{
+		return *cache_;
+	}
+
+	int64_t rank() const
+	{
+		return rank_;
+	}
+
+	int comb_size() const
+	{
+		return schedule_.comb_size();
+	}
+
+	const std::vector<int>& comb_to_main() const
+	{
+		return comb_to_main_;
+	}
+
+	const Eigen::MatrixXd& inverse() const
+	{
+		return inverse_;
+	}
+
+private:
+	block_engine_t(const main_matrix_t& main, const schedule_t& schedule, block_cache_t* cache)
+		:
+	main_(main),
+	schedule_(schedule),
+	cache_(cache),
+	block_size_(schedule.groups().empty() ? 0 : schedule.groups().back().pick),
+	rest_pivot_(schedule.comb_size() - block_size_ > block_size_)
+	{
+		if (!schedule.groups().empty() && schedule.groups().back().size > 64)
+		{
+			throw std::invalid_argument("block_engine_t: the last group has more than 64 items");
+		}
+
+		// The last group owns the lowest item indices
+		for (int item = 0; item < (schedule.groups().empty() ? 0 : schedule.groups().back().size); ++item)
+		{
+			group_items_.push_back(item);
+		}
+	}
+};
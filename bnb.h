@@ -0,0 +1,348 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <mutex>
+#include <vector>
+#include <omp.h>
+#include "eigen/Dense"
+
+#include "matrix.h"
+
+// Branch-and-bound search for the best k items of a symmetric positive definite
+// matrix, for objectives where interlacing gives a bound on every completion of
+// a partial selection. Whole subtrees are discarded once their bound cannot beat
+// the best complete selection found so far.
+
+// A partial selection S of the search with the inverse of A_S, grown by
+// bordering and shrunk by downdating as the search moves down and up the tree.
+class bnb_state_t
+{
+	const Eigen::MatrixXd& a_;
+	std::vector<int> items_;
+
+	// Inverse of A_S in the top-left corner, with room for k items
+	Eigen::MatrixXd inverse_;
+
+	// a(S, t) for a candidate t, and A_S^-1 a(S, t)
+	Eigen::VectorXd b_;
+	Eigen::VectorXd w_;
+
+	// log det(A_S) and trace(A_S^-1) before each push, to restore on pop
+	std::vector<double> logdets_;
+	std::vector<double> traces_;
+	double logdet_ = 0;
+	double trace_ = 0;
+
+public:
+	bnb_state_t(const Eigen::MatrixXd& a, int k)
+		:
+	a_(a),
+	inverse_(k, k),
+	b_(k),
+	w_(k)
+	{
+		items_.reserve(k);
+		logdets_.reserve(k);
+		traces_.reserve(k);
+	}
+
+	int size() const
+	{
+		return static_cast<int>(items_.size());
+	}
+
+	const std::vector<int>& items() const
+	{
+		return items_;
+	}
+
+	double logdet() const
+	{
+		return logdet_;
+	}
+
+	double trace_inverse() const
+	{
+		return trace_;
+	}
+
+	// Schur complement of candidate t given S: a(t, t) - a(t, S) A_S^-1 a(S, t).
+	// Leaves A_S^-1 a(S, t) in w_ for a following push(t).
+	double schur(int t)
+	{
+		auto m = size();
+		for (int i = 0; i < m; ++i)
+		{
+			b_[i] = a_(items_[i], t);
+		}
+		w_.head(m).noalias() = inverse_.topLeftCorner(m, m) * b_.head(m);
+		return a_(t, t) - b_.head(m).dot(w_.head(m));
+	}
+
+	// Add t to S by bordering the inverse. Returns false, leaving S unchanged,
+	// if the Schur complement shows A_S would no longer be positive definite.
+	bool push(int t)
+	{
+		auto s = schur(t);
+		if (!(s > 0))
+		{
+			return false;
+		}
+		auto m = size();
+		logdets_.push_back(logdet_);
+		traces_.push_back(trace_);
+		logdet_ += std::log(s);
+		trace_ += (1 + w_.head(m).squaredNorm()) / s;
+		border_inverse(inverse_, m, w_, s);
+		items_.push_back(t);
+		return true;
+	}
+
+	// Remove the most recently pushed item by downdating the inverse
+	void pop()
+	{
+		items_.pop_back();
+		downdate_inverse(inverse_, size());
+		logdet_ = logdets_.back();
+		trace_ = traces_.back();
+		logdets_.pop_back();
+		traces_.pop_back();
+	}
+};
+
+// Objectives are minimised. A complete selection has value(state). Adding candidate
+// t with Schur complement s, now or after more items, raises the value by at least
+// increment(s), because conditioning on more items only shrinks s. The search
+// bounds a subtree by value + the smallest increments of the remaining picks.
+
+// Maximise log det(A_S): by Fischer's inequality each added item contributes at
+// most log s.
+struct logdet_objective_t
+{
+	double value(const bnb_state_t& state) const
+	{
+		return -state.logdet();
+	}
+
+	double increment(double schur) const
+	{
+		return -std::log(schur);
+	}
+};
+
+// Minimise trace(A_S^-1): adding t raises it by (1 + |A_S^-1 a(S, t)|^2) / s >= 1 / s.
+struct trace_inverse_objective_t
+{
+	double value(const bnb_state_t& state) const
+	{
+		return state.trace_inverse();
+	}
+
+	double increment(double schur) const
+	{
+		return 1 / schur;
+	}
+};
+
+struct bnb_result_t
+{
+	double value = std::numeric_limits<double>::infinity();
+	std::vector<int> items;
+	int64_t nodes = 0;
+	int64_t pruned = 0;
+};
+
+// Best complete selection found so far, shared by all threads. The value is
+// atomic so bounds can be checked against it without taking the lock.
+class bnb_incumbent_t
+{
+	std::atomic<double> value_;
+	std::mutex mutex_;
+	std::vector<int> items_;
+
+public:
+	bnb_incumbent_t()
+		:
+	value_(std::numeric_limits<double>::infinity())
+	{
+	}
+
+	double value() const
+	{
+		return value_.load(std::memory_order_relaxed);
+	}
+
+	void offer(double value, const std::vector<int>& items)
+	{
+		if (value >= this->value())
+		{
+			return;
+		}
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (value < value_.load(std::memory_order_relaxed))
+		{
+			items_ = items;
+			value_.store(value, std::memory_order_relaxed);
+		}
+	}
+
+	std::vector<int> items()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		return items_;
+	}
+};
+
+// Depth-first search over selections that extend state with remaining items from
+// [next, n), in ascending order so each selection is visited once.
+template<class Objective>
+class bnb_search_t
+{
+	const Eigen::MatrixXd& a_;
+	const Objective& objective_;
+	bnb_incumbent_t& incumbent_;
+	bnb_state_t state_;
+
+	// Increment bounds of the candidates at each depth, and scratch for selecting the smallest
+	std::vector<std::vector<double>> increments_;
+	std::vector<double> smallest_;
+
+public:
+	int64_t nodes = 0;
+	int64_t pruned = 0;
+
+	bnb_search_t(const Eigen::MatrixXd& a, int k, const Objective& objective, bnb_incumbent_t& incumbent)
+		:
+	a_(a),
+	objective_(objective),
+	incumbent_(incumbent),
+	state_(a, k),
+	increments_(k + 1, std::vector<double>(a.rows())),
+	smallest_(a.rows())
+	{
+	}
+
+	bnb_state_t& state()
+	{
+		return state_;
+	}
+
+	void search(int next, int remaining)
+	{
+		++nodes;
+		if (remaining == 0)
+		{
+			incumbent_.offer(objective_.value(state_), state_.items());
+			return;
+		}
+		auto n = static_cast<int>(a_.rows());
+		auto count = n - next;
+		if (count < remaining)
+		{
+			return;
+		}
+
+		// Bound every completion by the smallest increments among the candidates
+		auto& increments = increments_[state_.size()];
+		for (int t = next; t < n; ++t)
+		{
+			auto s = state_.schur(t);
+			increments[t - next] = s > 0 ? objective_.increment(s) : std::numeric_limits<double>::infinity();
+		}
+		std::copy(increments.begin(), increments.begin() + count, smallest_.begin());
+		std::nth_element(smallest_.begin(), smallest_.begin() + remaining - 1, smallest_.begin() + count);
+		auto bound = objective_.value(state_);
+		for (int i = 0; i < remaining; ++i)
+		{
+			bound += smallest_[i];
+		}
+		if (!(bound < incumbent_.value()))
+		{
+			++pruned;
+			return;
+		}
+
+		for (int t = next; t <= n - remaining; ++t)
+		{
+			if (increments[t - next] == std::numeric_limits<double>::infinity() || !state_.push(t))
+			{
+				continue;
+			}
+			search(t + 1, remaining - 1);
+			state_.pop();
+		}
+	}
+};
+
+// Greedily add the candidate with the smallest increment, to seed the incumbent
+template<class Objective>
+void bnb_greedy(const Eigen::MatrixXd& a, int k, const Objective& objective, bnb_incumbent_t& incumbent)
+{
+	bnb_state_t state(a, k);
+	std::vector<char> used(a.rows(), false);
+	while (state.size() < k)
+	{
+		auto best = -1;
+		auto best_increment = std::numeric_limits<double>::infinity();
+		for (int t = 0; t < a.rows(); ++t)
+		{
+			auto s = used[t] ? 0.0 : state.schur(t);
+			if (s > 0 && objective.increment(s) < best_increment)
+			{
+				best = t;
+				best_increment = objective.increment(s);
+			}
+		}
+		if (best < 0 || !state.push(best))
+		{
+			return;
+		}
+		used[best] = true;
+	}
+	auto items = state.items();
+	std::sort(items.begin(), items.end());
+	incumbent.offer(objective.value(state), items);
+}
+
+// Find the k items of the symmetric positive definite matrix a minimising objective.
+// Subtrees rooted at each choice of first item are searched in parallel, all
+// pruning against one shared incumbent.
+template<class Objective>
+bnb_result_t branch_and_bound(const Eigen::MatrixXd& a, int k, const Objective& objective, int threads = 0)
+{
+	bnb_result_t result;
+	bnb_incumbent_t incumbent;
+	auto n = static_cast<int>(a.rows());
+	if (k <= 0 || k > n)
+	{
+		return result;
+	}
+	bnb_greedy(a, k, objective, incumbent);
+
+	int64_t nodes = 0;
+	int64_t pruned = 0;
+	threads = threads > 0 ? threads : omp_get_max_threads();
+	#pragma omp parallel num_threads(threads) reduction(+: nodes, pruned)
+	{
+		bnb_search_t<Objective> search(a, k, objective, incumbent);
+		#pragma omp for schedule(dynamic, 1)
+		for (int first = 0; first <= n - k; ++first)
+		{
+			if (search.state().push(first))
+			{
+				search.search(first + 1, k - 1);
+				search.state().pop();
+			}
+		}
+		nodes += search.nodes;
+		pruned += search.pruned;
+	}
+
+	result.value = incumbent.value();
+	result.items = incumbent.items();
+	result.nodes = nodes;
+	result.pruned = pruned;
+	return result;
+}
@@ -0,0 +1,284 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <omp.h>
+#include "eigen/Core"
+
+#include "alloc.h"
+#include "schedule.h"
+
+// Checkpointing for long enumerations. The schedule is split into one range per
+// worker and each worker periodically saves the rank of its last visited
+// combination, its inverse there and its partial reduction. Restoring the exact
+// inverse rather than recomputing it makes a resumed run bit-for-bit identical
+// to an uninterrupted one, for engines without condition tracking: a tracking
+// engine recomputes its norms on restore rather than carrying the updated ones,
+// so its re-anchoring decisions, and with them the inverses, may differ.
+
+struct checkpoint_options_t
+{
+	// Worker i saves to path + "." + i
+	std::string path;
+
+	// Number of ranges to split the schedule into. A resumed run keeps the
+	// number it was started with.
+	int workers = 0;
+
+	// Minimum time between saves of one worker
+	double interval_seconds = 10;
+};
+
+// The saved state of one worker
+template<class Reduction>
+struct worker_checkpoint_t
+{
+	int64_t begin = 0;
+	int64_t end = 0;
+
+	// Last combination visited
+	int64_t rank = -1;
+	Eigen::MatrixXd inverse;
+	Reduction reduction{};
+};
+
+// FNV-1a over bytes, continuing from hash
+inline uint64_t checkpoint_hash(uint64_t hash, const void* data, size_t size)
+{
+	auto bytes = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < size; ++i)
+	{
+		hash = (hash ^ bytes[i]) * 1099511628211ull;
+	}
+	return hash;
+}
+
+// Identifies the main matrix and the groups a checkpoint belongs to. Schedules
+// with the same combination count and size but different groups visit
+// different combinations at the same rank.
+inline uint64_t checkpoint_fingerprint(const Eigen::MatrixXd& main, const schedule_t& schedule)
+{
+	auto hash = checkpoint_hash(14695981039346656037ull, main.data(), main.size() * sizeof(double));
+	for (const auto& group : schedule.groups())
+	{
+		int32_t fields[] = { group.size, group.pick };
+		hash = checkpoint_hash(hash, fields, sizeof(fields));
+	}
+	return hash;
+}
+
+// Header identifying what a worker checkpoint was taken from
+struct checkpoint_header_t
+{
+	char magic[8];
+	uint64_t fingerprint;
+	int64_t combinations;
+	int32_t comb_size;
+	int32_t workers;
+	int32_t worker;
+	int32_t reduction_size;
+};
+
+inline std::string checkpoint_file(const checkpoint_options_t& options, int worker)
+{
+	return options.path + "." + std::to_string(worker);
+}
+
+inline checkpoint_header_t make_checkpoint_header(uint64_t fingerprint, const schedule_t& schedule, int workers, int worker, size_t reduction_size)
+{
+	checkpoint_header_t header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, "INVCKP01", 8);
+	header.fingerprint = fingerprint;
+	header.combinations = schedule.combinations();
+	header.comb_size = schedule.comb_size();
+	header.workers = workers;
+	header.worker = worker;
+	header.reduction_size = static_cast<int32_t>(reduction_size);
+	return header;
+}
+
+// Number of workers of an existing checkpoint under options.path, or 0 if none
+inline int saved_checkpoint_workers(const checkpoint_options_t& options)
+{
+	std::ifstream in(checkpoint_file(options, 0), std::ios::binary);
+	checkpoint_header_t header;
+	if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) || std::memcmp(header.magic, "INVCKP01", 8) != 0)
+	{
+		return 0;
+	}
+	return header.workers;
+}
+
+// Write to a temporary file and rename it over the previous checkpoint, so an
+// interruption mid-write leaves the previous one intact. Returns false on failure.
+template<class Reduction>
+bool save_checkpoint(const std::string& path, const checkpoint_header_t& header, const worker_checkpoint_t<Reduction>& checkpoint)
+{
+	auto temp = path + ".tmp";
+	{
+		std::ofstream out(temp, std::ios::binary);
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		int64_t ranks[] = { checkpoint.begin, checkpoint.end, checkpoint.rank };
+		out.write(reinterpret_cast<const char*>(ranks), sizeof(ranks));
+		auto has_inverse = checkpoint.inverse.size() > 0;
+		out.write(reinterpret_cast<const char*>(&has_inverse), sizeof(has_inverse));
+		if (has_inverse)
+		{
+			out.write(reinterpret_cast<const char*>(checkpoint.inverse.data()), checkpoint.inverse.size() * sizeof(double));
+		}
+		out.write(reinterpret_cast<const char*>(&checkpoint.reduction), sizeof(Reduction));
+		if (!out)
+		{
+			return false;
+		}
+	}
+	return std::rename(temp.c_str(), path.c_str()) == 0;
+}
+
+// Read a worker checkpoint, returning false if there is none or it was taken
+// from a different main matrix, schedule, worker count or reduction
+template<class Reduction>
+bool load_checkpoint(const std::string& path, const checkpoint_header_t& expected, worker_checkpoint_t<Reduction>& checkpoint)
+{
+	std::ifstream in(path, std::ios::binary);
+	checkpoint_header_t header;
+	if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) || std::memcmp(&header, &expected, sizeof(header)) != 0)
+	{
+		return false;
+	}
+	int64_t ranks[3];
+	auto has_inverse = false;
+	in.read(reinterpret_cast<char*>(ranks), sizeof(ranks));
+	in.read(reinterpret_cast<char*>(&has_inverse), sizeof(has_inverse));
+	Eigen::MatrixXd inverse;
+	if (has_inverse)
+	{
+		inverse.resize(header.comb_size, header.comb_size);
+		in.read(reinterpret_cast<char*>(inverse.data()), inverse.size() * sizeof(double));
+	}
+	Reduction reduction;
+	in.read(reinterpret_cast<char*>(&reduction), sizeof(Reduction));
+	if (!in)
+	{
+		return false;
+	}
+	checkpoint.begin = ranks[0];
+	checkpoint.end = ranks[1];
+	checkpoint.rank = ranks[2];
+	checkpoint.inverse = inverse;
+	checkpoint.reduction = reduction;
+	return true;
+}
+
+// Enumerate the schedule with Engine, which must support restore(rank, inverse),
+// calling visit(reduction, engine) at every combination with the worker's
+// trivially copyable Reduction. Workers resume from their checkpoints under
+// options.path if present. Returns every worker's final reduction.
+//
+// A worker whose save fails stops there, as resuming would otherwise start
+// from a stale checkpoint, and once all workers are done a std::runtime_error
+// names the first file that could not be saved.
+//
+// The clock is only read every check_interval steps, and those steps run in a
+// no_alloc_scope_t, so visit must not allocate.
+template<class Engine, class Reduction, class Visit>
+std::vector<Reduction> enumerate_checkpointed(const Eigen::MatrixXd& main, const schedule_t& schedule, const checkpoint_options_t& options, Visit&& visit)
+{
+	static_assert(std::is_trivially_copyable<Reduction>::value, "checkpointed reductions are saved as bytes");
+	const int64_t check_interval = 1024;
+	auto workers = saved_checkpoint_workers(options);
+	if (workers <= 0)
+	{
+		workers = options.workers > 0 ? options.workers : omp_get_max_threads();
+	}
+	auto fingerprint = checkpoint_fingerprint(main, schedule);
+	std::vector<Reduction> reductions(workers);
+	std::vector<char> failed(workers, false);
+
+	#pragma omp parallel for schedule(dynamic, 1)
+	for (int worker = 0; worker < workers; ++worker)
+	{
+		auto path = checkpoint_file(options, worker);
+		auto header = make_checkpoint_header(fingerprint, schedule, workers, worker, sizeof(Reduction));
+		worker_checkpoint_t<Reduction> checkpoint;
+		Engine engine(main, schedule);
+		if (load_checkpoint(path, header, checkpoint))
+		{
+			if (checkpoint.rank + 1 < checkpoint.end)
+			{
+				engine.restore(checkpoint.rank, checkpoint.inverse);
+			}
+		}
+		else
+		{
+			checkpoint = worker_checkpoint_t<Reduction>();
+			checkpoint.begin = schedule.combinations() * worker / workers;
+			checkpoint.end = schedule.combinations() * (worker + 1) / workers;
+			checkpoint.rank = checkpoint.begin;
+			if (checkpoint.begin < checkpoint.end)
+			{
+				engine.seed(checkpoint.begin);
+				visit(checkpoint.reduction, static_cast<const Engine&>(engine));
+			}
+		}
+
+		auto last_save = std::chrono::steady_clock::now();
+		while (checkpoint.rank + 1 < checkpoint.end)
+		{
+			auto stop = std::min(checkpoint.end, checkpoint.rank + 1 + check_interval);
+			{
+				no_alloc_scope_t scope;
+				for (auto n = checkpoint.rank + 1; n < stop; ++n)
+				{
+					engine.step();
+					visit(checkpoint.reduction, static_cast<const Engine&>(engine));
+				}
+			}
+			checkpoint.rank = stop - 1;
+
+			auto now = std::chrono::steady_clock::now();
+			if (std::chrono::duration<double>(now - last_save).count() >= options.interval_seconds)
+			{
+				checkpoint.inverse = engine.inverse();
+				if (!save_checkpoint(path, header, checkpoint))
+				{
+					failed[worker] = true;
+					break;
+				}
+				last_save = now;
+			}
+		}
+
+		// A finished worker keeps only its reduction
+		if (!failed[worker])
+		{
+			checkpoint.inverse.resize(0, 0);
+			failed[worker] = !save_checkpoint(path, header, checkpoint);
+		}
+		reductions[worker] = checkpoint.reduction;
+	}
+
+	auto first_failed = std::find(failed.begin(), failed.end(), true);
+	if (first_failed != failed.end())
+	{
+		throw std::runtime_error("cannot save checkpoint " + checkpoint_file(options, static_cast<int>(first_failed - failed.begin())));
+	}
+	return reductions;
+}
+
+// Remove the checkpoint files of a finished enumeration
+inline void remove_checkpoints(const checkpoint_options_t& options, int workers)
+{
+	for (int worker = 0; worker < workers; ++worker)
+	{
+		std::remove(checkpoint_file(options, worker).c_str());
+	}
+}
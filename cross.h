@@ -0,0 +1,286 @@
+#pragma once
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#include "eigen/Dense"
+
+#include "matrix.h"
+#include "phase.h"
+#include "schedule.h"
+#include "sherman.h"
+
+// One step of a cross schedule: a swap of the row selection or of the column
+// selection, never both
+struct cross_swap_t
+{
+	bool row;
+	swap_t swap;
+};
+
+// Enumerates every pair of a row selection and a column selection, each from
+// its own schedule, so that combinations are the non-principal submatrices
+// A[R, C] of a main matrix whose rows are the row schedule's items and whose
+// columns are the column schedule's. Both selections must pick the same number
+// of items.
+//
+// The pairs are interleaved like the groups of make_schedule: the column
+// selection changes fastest and is walked forwards and then backwards, as
+// gray_generator_t replays its sequence in reverse, and the row selection
+// advances at each turn. Every step is a single swap.
+class cross_schedule_t
+{
+	std::shared_ptr<const schedule_t> rows_;
+	std::shared_ptr<const schedule_t> cols_;
+
+public:
+	cross_schedule_t(std::shared_ptr<const schedule_t> rows, std::shared_ptr<const schedule_t> cols)
+		:
+	rows_(std::move(rows)),
+	cols_(std::move(cols))
+	{
+		if (rows_->comb_size() != cols_->comb_size())
+		{
+			throw std::invalid_argument("cross_schedule_t: row and column selections differ in size");
+		}
+	}
+
+	const schedule_t& rows() const
+	{
+		return *rows_;
+	}
+
+	const schedule_t& cols() const
+	{
+		return *cols_;
+	}
+
+	int comb_size() const
+	{
+		return rows_->comb_size();
+	}
+
+	// Number of combinations, including the initial one
+	int64_t combinations() const
+	{
+		return rows_->combinations() * cols_->combinations();
+	}
+
+	// Step leading from combination rank to rank + 1
+	cross_swap_t operator[](int64_t rank) const
+	{
+		auto col_count = cols_->combinations();
+		auto next = rank + 1;
+		if (next % col_count == 0)
+		{
+			return { true, (*rows_)[next / col_count - 1] };
+		}
+		auto col_rank = rank % col_count;
+		if ((rank / col_count) % 2 == 0)
+		{
+			return { false, (*cols_)[col_rank] };
+		}
+
+		// Walking back, undo the swap that led to this column selection
+		const auto& swap = (*cols_)[col_count - 2 - col_rank];
+		return { false, { swap.added, swap.removed, swap.slot } };
+	}
+
+	// Rank in the row and column schedules of the selections at combination rank
+	int64_t row_rank(int64_t rank) const
+	{
+		return rank / cols_->combinations();
+	}
+
+	int64_t col_rank(int64_t rank) const
+	{
+		auto col_count = cols_->combinations();
+		auto col_rank = rank % col_count;
+		return (rank / col_count) % 2 == 0 ? col_rank : col_count - 1 - col_rank;
+	}
+};
+
+// Enumerates the combinations of a cross schedule for one main matrix, which
+// has rows().size() rows and cols().size() columns. As in sherman_engine_t the
+// inverse is computed directly at the seed and then updated, but a step only
+// replaces a row or a column, so it costs one Sherman-Morrison rank-1 update
+// instead of two. The interface matches sherman_engine_t with comb_to_main split
+// into row_to_main and col_to_main. Row i of the inverse belongs to column item
+// col_to_main()[i] and column j to row item row_to_main()[j].
+class cross_sherman_engine_t
+{
+	main_matrix_t main_;
+	const cross_schedule_t& schedule_;
+	int64_t rank_ = 0;
+
+	// Index into the main matrix of each row, and of each column, of the combination
+	std::vector<int> row_to_main_;
+	std::vector<int> col_to_main_;
+
+	Eigen::MatrixXd inverse_;
+
+	// Replacement row/column, update vectors and workspace, sized once in seed
+	Eigen::RowVectorXd new_row_;
+	Eigen::VectorXd new_col_;
+	Eigen::VectorXd work_col_;
+	Eigen::RowVectorXd work_row_;
+
+	// Factorisation used for direct inversions
+	Eigen::PartialPivLU<Eigen::MatrixXd> lu_;
+
+	// Singular handling as in sherman_engine_t, except that a rejected update is
+	// always replaced by a direct inversion: with a single swap per step there is
+	// no intermediate matrix to reorder around.
+	double singular_tolerance_ = std::sqrt(std::numeric_limits<double>::epsilon());
+	bool singular_ = false;
+	sherman_fallbacks_t fallbacks_;
+
+public:
+	// step() works entirely in preallocated storage
+	static const bool allocates_in_step = false;
+
+	cross_sherman_engine_t(const main_matrix_t& main, const cross_schedule_t& schedule)
+		:
+	main_(main),
+	schedule_(schedule)
+	{
+	}
+
+	// Compute the inverse of combination rank directly
+	void seed(int64_t rank)
+	{
+		rank_ = rank;
+		row_to_main_ = schedule_.rows().selection_at(schedule_.row_rank(rank));
+		col_to_main_ = schedule_.cols().selection_at(schedule_.col_rank(rank));
+		auto n = comb_size();
+		new_row_.resize(n);
+		new_col_.resize(n);
+		work_col_.resize(n);
+		work_row_.resize(n);
+		invert_directly();
+	}
+
+	// Advance to the next combination by replacing one row or one column
+	void step()
+	{
+		cross_swap_t step;
+		{
+			PHASE_SCOPE(phase_gray);
+			step = schedule_[rank_];
+			++rank_;
+		}
+		const auto& swap = step.swap;
+		if (step.row)
+		{
+			{
+				PHASE_SCOPE(phase_mapping);
+				row_to_main_[swap.slot] = swap.added;
+			}
+			{
+				PHASE_SCOPE(phase_gather);
+				row_map(main_, swap.added, col_to_main_, new_row_);
+			}
+			if (singular_)
+			{
+				fallback_direct();
+				return;
+			}
+			PHASE_SCOPE(phase_row_update);
+			new_row_ -= indexed_view(main_, single_index_t{ swap.removed }, col_to_main_);
+			if (!(std::abs(1 + new_row_.dot(inverse_.col(swap.slot))) >= singular_tolerance_))
+			{
+				fallback_direct();
+				return;
+			}
+			sherman_morrison_update_row(inverse_, swap.slot, new_row_, work_col_, work_row_);
+		}
+		else
+		{
+			{
+				PHASE_SCOPE(phase_mapping);
+				col_to_main_[swap.slot] = swap.added;
+			}
+			{
+				PHASE_SCOPE(phase_gather);
+				col_map(main_, swap.added, row_to_main_, new_col_);
+			}
+			if (singular_)
+			{
+				fallback_direct();
+				return;
+			}
+			PHASE_SCOPE(phase_col_update);
+			new_col_ -= indexed_view(main_, row_to_main_, single_index_t{ swap.removed });
+			if (!(std::abs(1 + inverse_.row(swap.slot).dot(new_col_)) >= singular_tolerance_))
+			{
+				fallback_direct();
+				return;
+			}
+			sherman_morrison_update_col(inverse_, swap.slot, new_col_, work_col_, work_row_);
+		}
+	}
+
+	// See sherman_engine_t::set_singular_tolerance
+	void set_singular_tolerance(double tolerance)
+	{
+		singular_tolerance_ = tolerance;
+	}
+
+	// True if the current combination is singular, in which case inverse() is NaN
+	bool singular() const
+	{
+		return singular_;
+	}
+
+	const sherman_fallbacks_t& fallbacks() const
+	{
+		return fallbacks_;
+	}
+
+	// Rank of the current combination in the schedule
+	int64_t rank() const
+	{
+		return rank_;
+	}
+
+	int comb_size() const
+	{
+		return schedule_.comb_size();
+	}
+
+	const std::vector<int>& row_to_main() const
+	{
+		return row_to_main_;
+	}
+
+	const std::vector<int>& col_to_main() const
+	{
+		return col_to_main_;
+	}
+
+	const Eigen::MatrixXd& inverse() const
+	{
+		return inverse_;
+	}
+
+private:
+	// Invert the current combination directly without allocating, marking it
+	// singular as sherman_engine_t::invert_directly does
+	void invert_directly()
+	{
+		lu_.compute(indexed_view(main_, row_to_main_, col_to_main_));
+		inverse_.resize(comb_size(), comb_size());
+		singular_ = !lu_inverse(lu_, inverse_);
+		if (singular_)
+		{
+			++fallbacks_.singular;
+		}
+	}
+
+	void fallback_direct()
+	{
+		++fallbacks_.direct;
+		invert_directly();
+	}
+};
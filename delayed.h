@@ -0,0 +1,235 @@
+#pragma once
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+#include "eigen/Dense"
+
+#include "factored.h"
+#include "matrix.h"
+#include "phase.h"
+#include "schedule.h"
+#include "sherman.h"
+
+// Enumerates a schedule like sherman_engine_t, but defers the updates. A swap
+// changes row and column slot of the combination, A' = A + e_s v + u e_s^T, and
+// is added to a factored_inverse_t as a rank-2 correction. A step then only
+// reads the base inverse B, for the two products B u and v B, and borders the
+// small capacitance inverse; no pass writes the k x k inverse. Every delay
+// steps the corrections are folded into B with one rank-2m product, which is
+// compute-bound where the rank-1 updates of sherman_engine_t are bound by
+// memory bandwidth, so this pays off once the inverse no longer fits in cache.
+//
+// Between folds, factored() answers coeff, diagonal, trace and solve from the
+// factored form. inverse() materializes the inverse at the cost of a fold, so
+// visitors that read it at every step should use the sherman engine instead.
+//
+// Accuracy is kept in two ways. factored_inverse_t rejects a swap whose
+// correction grows far beyond B, and the new combination is inverted directly.
+// And each fold checks the residual A B x - x for a fixed probe x in O(k^2),
+// re-anchoring, as basic_sherman_engine_t does, once the rounding errors
+// folded into B exceed the singular tolerance. On diagonally dominant mains
+// neither triggers and the inverses agree with direct inversion to about
+// 1e-13. On random mains that are not, they agree to about 1e-7 relative, as
+// those of the sherman engine do, at the price of direct inversions at 5 to
+// 10% of the steps.
+
+class delayed_sherman_engine_t
+{
+	main_matrix_t main_;
+	const schedule_t& schedule_;
+	int64_t rank_ = 0;
+	std::vector<int> comb_to_main_;
+	factored_inverse_t inverse_;
+
+	// Gathered operands, as in sherman_engine_t
+	Eigen::RowVectorXd new_row_;
+	Eigen::VectorXd new_col_;
+	Eigen::RowVectorXd v_row_;
+	Eigen::VectorXd u_col_;
+
+	Eigen::PartialPivLU<Eigen::MatrixXd> lu_;
+	bool singular_ = false;
+	int64_t direct_ = 0;
+
+	// Residual check after folds: the probe x, B x and A B x - x
+	Eigen::VectorXd probe_;
+	Eigen::VectorXd probe_image_;
+	Eigen::VectorXd residual_;
+	double residual_tolerance_ = std::sqrt(std::numeric_limits<double>::epsilon());
+	int64_t checked_folds_ = 0;
+	int64_t reanchors_ = 0;
+
+	// Invert the combination into the base of inverse_, as in basic_sherman_engine_t
+	void invert_directly()
+	{
+		lu_.compute(indexed_view(main_, comb_to_main_, comb_to_main_));
+		singular_ = !lu_inverse(lu_, inverse_.base());
+		inverse_.clear();
+		checked_folds_ = inverse_.folds();
+	}
+
+	// Re-anchor if a fold since the last check left B inaccurate
+	void check_fold()
+	{
+		if (inverse_.folds() == checked_folds_)
+		{
+			return;
+		}
+		checked_folds_ = inverse_.folds();
+		if (!base_accurate())
+		{
+			++reanchors_;
+			invert_directly();
+		}
+	}
+
+	// True if the base inverse B still inverts the combination A to within the
+	// tolerance, going by |A B x - x| for the probe x. A is read in place.
+	bool base_accurate()
+	{
+		probe_image_.noalias() = inverse_.base() * probe_;
+		residual_ = -probe_;
+		auto n = comb_size();
+		for (int c = 0; c < n; ++c)
+		{
+			auto column = comb_to_main_[c];
+			for (int r = 0; r < n; ++r)
+			{
+				residual_[r] += main_(comb_to_main_[r], column) * probe_image_[c];
+			}
+		}
+		return residual_.cwiseAbs().maxCoeff() <= residual_tolerance_;
+	}
+
+public:
+	static const bool allocates_in_step = false;
+
+	// Fold the corrections into the base inverse every delay swaps
+	delayed_sherman_engine_t(const main_matrix_t& main, const schedule_t& schedule, int delay = 8)
+		:
+	main_(main),
+	schedule_(schedule),
+	inverse_(2 * delay)
+	{
+		if (delay < 1)
+		{
+			throw std::invalid_argument("delayed_sherman_engine_t: delay must be positive");
+		}
+	}
+
+	void seed(int64_t rank)
+	{
+		rank_ = rank;
+		comb_to_main_ = schedule_.selection_at(rank);
+		auto n = comb_size();
+		inverse_.resize(n);
+		new_row_.resize(n);
+		new_col_.resize(n);
+		v_row_.resize(n);
+		u_col_.resize(n);
+		probe_image_.resize(n);
+		residual_.resize(n);
+
+		// Any fixed vector with no structure of its own serves as probe
+		probe_.resize(n);
+		for (int i = 0; i < n; ++i)
+		{
+			probe_[i] = std::sin(i + 1.0);
+		}
+		invert_directly();
+	}
+
+	void step()
+	{
+		const swap_t* swap;
+		{
+			PHASE_SCOPE(phase_gray);
+			swap = &schedule_[rank_];
+			++rank_;
+		}
+		{
+			PHASE_SCOPE(phase_mapping);
+			comb_to_main_[swap->slot] = swap->added;
+		}
+		{
+			PHASE_SCOPE(phase_gather);
+			gather_swap(main_, *swap, comb_to_main_, new_row_, new_col_, v_row_, u_col_);
+		}
+
+		// After a singular combination there is nothing to update
+		PHASE_SCOPE(phase_row_update);
+		if (singular_ || !inverse_.update_swap(swap->slot, v_row_, u_col_))
+		{
+			++direct_;
+			invert_directly();
+			return;
+		}
+		check_fold();
+	}
+
+	// Smallest |det S| of a swap for which it is accumulated rather than the new
+	// combination inverted directly, see basic_sherman_engine_t, and largest
+	// residual |A B x - x| after a fold, with |x| at most 1, before re-anchoring
+	void set_singular_tolerance(double tolerance)
+	{
+		inverse_.set_singular_tolerance(tolerance);
+		residual_tolerance_ = tolerance;
+	}
+
+	// See factored_inverse_t::set_growth_limit
+	void set_growth_limit(double limit)
+	{
+		inverse_.set_growth_limit(limit);
+	}
+
+	bool singular() const
+	{
+		return singular_;
+	}
+
+	// Folds and direct inversions since construction
+	int64_t folds() const
+	{
+		return inverse_.folds();
+	}
+
+	int64_t direct() const
+	{
+		return direct_;
+	}
+
+	// Re-anchors after a fold left B inaccurate, since construction
+	int64_t reanchors() const
+	{
+		return reanchors_;
+	}
+
+	int64_t rank() const
+	{
+		return rank_;
+	}
+
+	int comb_size() const
+	{
+		return schedule_.comb_size();
+	}
+
+	const std::vector<int>& comb_to_main() const
+	{
+		return comb_to_main_;
+	}
+
+	// The inverse of the current combination in factored form
+	const factored_inverse_t& factored() const
+	{
+		return inverse_;
+	}
+
+	// The inverse of the current combination, materialized on first use after a
+	// step at the cost of a fold
+	const Eigen::MatrixXd& inverse() const
+	{
+		return inverse_.materialize();
+	}
+};
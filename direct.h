@@ -0,0 +1,72 @@
+#pragma once
+#include <vector>
+#include "eigen/Dense"
+
+#include "matrix.h"
+#include "schedule.h"
+
+// Enumerates the combinations of a schedule for one main matrix, computing every
+// inverse directly. This is the reference the update engines are measured against
+// and has the same interface as sherman_engine_t.
+class direct_engine_t
+{
+	main_matrix_t main_;
+	const schedule_t& schedule_;
+	int64_t rank_ = 0;
+	std::vector<int> comb_to_main_;
+	Eigen::MatrixXd inverse_;
+
+public:
+	// Every step builds and inverts a new combination matrix
+	static const bool allocates_in_step = true;
+
+	direct_engine_t(const main_matrix_t& main, const schedule_t& schedule)
+		:
+	main_(main),
+	schedule_(schedule)
+	{
+	}
+
+	void seed(int64_t rank)
+	{
+		rank_ = rank;
+		comb_to_main_ = schedule_.selection_at(rank);
+		inverse_ = indexed_view(main_, comb_to_main_, comb_to_main_).inverse();
+	}
+
+	void step()
+	{
+		const auto& swap = schedule_[rank_];
+		++rank_;
+		comb_to_main_[swap.slot] = swap.added;
+		inverse_ = indexed_view(main_, comb_to_main_, comb_to_main_).inverse();
+	}
+
+	int64_t rank() const
+	{
+		return rank_;
+	}
+
+	int comb_size() const
+	{
+		return schedule_.comb_size();
+	}
+
+	const std::vector<int>& comb_to_main() const
+	{
+		return comb_to_main_;
+	}
+
+	const Eigen::MatrixXd& inverse() const
+	{
+		return inverse_;
+	}
+
+	// Reciprocal 1-norm condition number of the current combination, as in sherman_engine_t
+	double rcond() const
+	{
+		auto norm = indexed_view(main_, comb_to_main_, comb_to_main_).cwiseAbs().colwise().sum().maxCoeff();
+		auto inverse_norm = inverse_.cwiseAbs().colwise().sum().maxCoeff();
+		return norm > 0 && inverse_norm > 0 ? 1 / (norm * inverse_norm) : 0;
+	}
+};
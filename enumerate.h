@@ -0,0 +1,83 @@
+#pragma once
+#include <omp.h>
+#include "eigen/Core"
+
+#include "alloc.h"
+#include "matrix.h"
+#include "schedule.h"
+
+// Seed engine at begin, also passing end to engines that work ahead of the
+// steps taken and take it, such as streamed_sherman_engine_t
+template<class Engine>
+auto seed_range(Engine& engine, int64_t begin, int64_t end, int) -> decltype(engine.seed(begin, end))
+{
+	engine.seed(begin, end);
+}
+
+template<class Engine>
+void seed_range(Engine& engine, int64_t begin, int64_t, long)
+{
+	engine.seed(begin);
+}
+
+// Visit combinations [begin, end) of the engine's schedule, seeding the inverse
+// directly at begin and calling visit(engine) at every combination. Unless the
+// engine declares that its steps allocate, the stepping loop runs in a
+// no_alloc_scope_t, so visit must not allocate either.
+template<class Engine, class Visit>
+void enumerate_range(Engine& engine, int64_t begin, int64_t end, Visit&& visit)
+{
+	if (begin >= end)
+	{
+		return;
+	}
+	seed_range(engine, begin, end, 0);
+	visit(engine);
+
+	auto steady_state = [&]()
+	{
+		for (auto n = begin + 1; n < end; ++n)
+		{
+			engine.step();
+			visit(engine);
+		}
+	};
+	if (Engine::allocates_in_step)
+	{
+		steady_state();
+	}
+	else
+	{
+		no_alloc_scope_t scope;
+		steady_state();
+	}
+}
+
+// Number of threads enumerate_openmp will use for a requested count, where zero
+// or less means the OpenMP default.
+inline int enumerate_threads(int threads)
+{
+	return threads > 0 ? threads : omp_get_max_threads();
+}
+
+// Split the schedule into one contiguous range of combinations per thread. Each
+// thread seeds its own engine at the start of its range, so there are no
+// dependencies between threads. visit(thread, engine) is called at every combination.
+template<class Engine, class Visit>
+void enumerate_openmp(const main_matrix_t& main, const schedule_t& schedule, int threads, Visit&& visit)
+{
+	threads = enumerate_threads(threads);
+	#pragma omp parallel num_threads(threads)
+	{
+		auto thread = omp_get_thread_num();
+		auto count = omp_get_num_threads();
+		auto begin = schedule.combinations() * thread / count;
+		auto end = schedule.combinations() * (thread + 1) / count;
+
+		Engine engine(main, schedule);
+		enumerate_range(engine, begin, end, [&](const Engine& e)
+		{
+			visit(thread, e);
+		});
+	}
+}
@@ -0,0 +1,454 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "eigen/Dense"
+
+#include "matrix.h"
+
+// The inverse of A = A0 + U V held as the inverse B of A0 and the low-rank
+// correction of Woodbury's identity,
+//   A^-1 = B - P C^-1 Q,  P = B U,  Q = V B,  C = I + V P,
+// so that consumers reading a few entries, the diagonal, the trace or a solve
+// never pay for the k x k inverse. Corrections are added a term u v at a time,
+// or two at once for the swap of a row and column, bordering C^-1 as they go;
+// once max_rank terms have built up they are folded into B with one rank-r
+// product. materialize() forms the full inverse only when asked for.
+//
+// Terms whose u or v is a unit vector, as for row and column replacements, are
+// stored as an index, so P's column is a copy of a column of B and V's row a
+// lookup. Nothing is allocated after resize().
+class factored_inverse_t
+{
+	typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, 0, 2, 2> schur_t;
+
+	int max_rank_;
+	int rank_ = 0;
+	Eigen::MatrixXd base_;
+
+	// Term a is U.col(a) V.row(a), with u_unit_[a] or v_unit_[a] the index of a
+	// unit vector or -1 for the dense vector in u_ or v_. V and Q are stored
+	// transposed so that their rows are contiguous.
+	std::vector<int> u_unit_;
+	std::vector<int> v_unit_;
+	Eigen::MatrixXd u_;
+	Eigen::MatrixXd v_;
+	Eigen::MatrixXd p_;
+	Eigen::MatrixXd q_;
+	Eigen::MatrixXd c_inverse_;
+
+	// Largest entry of each column of P and Q, and of B or -1 until it is
+	// needed, for the growth test of border
+	Eigen::VectorXd p_max_;
+	Eigen::VectorXd q_max_;
+	double base_max_ = -1;
+
+	// Q P, for trace()
+	Eigen::MatrixXd qp_;
+
+	// Bordering workspace: the new columns and rows of C, C^-1 times them
+	Eigen::MatrixXd c_cols_;
+	Eigen::MatrixXd c_rows_;
+	Eigen::MatrixXd x_;
+	Eigen::MatrixXd y_;
+	Eigen::MatrixXd x_s_;
+	Eigen::MatrixXd y_s_;
+
+	// Query workspace and the materialized inverse, valid while materialized_.
+	// C^-1 Q is kept from the last diagonal() or materialize() until the next
+	// update, while c_inverse_q_valid_.
+	mutable Eigen::MatrixXd c_inverse_q_;
+	mutable Eigen::VectorXd work_;
+	mutable Eigen::VectorXd work2_;
+	mutable Eigen::MatrixXd inverse_;
+	mutable bool materialized_ = false;
+	mutable bool c_inverse_q_valid_ = false;
+
+	double singular_tolerance_ = std::sqrt(std::numeric_limits<double>::epsilon());
+	double growth_limit_ = 1e4;
+	int64_t folds_ = 0;
+
+	// Row a of V dotted with x
+	double v_dot(int a, const Eigen::Ref<const Eigen::VectorXd>& x) const
+	{
+		return v_unit_[a] >= 0 ? x[v_unit_[a]] : v_.col(a).dot(x);
+	}
+
+	// Set up term a of U V in P and Q from u_unit_/u_ and v_unit_/v_
+	void factor_term(int a)
+	{
+		if (u_unit_[a] >= 0)
+		{
+			p_.col(a) = base_.col(u_unit_[a]);
+		}
+		else
+		{
+			p_.col(a).noalias() = base_ * u_.col(a);
+		}
+		if (v_unit_[a] >= 0)
+		{
+			q_.col(a) = base_.row(v_unit_[a]).transpose();
+		}
+		else
+		{
+			q_.col(a).noalias() = base_.transpose() * v_.col(a);
+		}
+		p_max_[a] = p_.col(a).cwiseAbs().maxCoeff();
+		q_max_[a] = q_.col(a).cwiseAbs().maxCoeff();
+	}
+
+	// Take terms [rank_, rank_ + count) into C^-1, count at most 2. False, with
+	// the terms dropped, if the corrected matrix would be near singular, or if
+	// P C^-1 Q would grow beyond the growth limit times B, see set_growth_limit.
+	bool border(int count)
+	{
+		auto j = rank_;
+		for (int b = j; b < j + count; ++b)
+		{
+			factor_term(b);
+		}
+
+		// The new columns and rows of C = I + V P, and of Q P
+		for (int a = 0; a < j + count; ++a)
+		{
+			for (int b = j; b < j + count; ++b)
+			{
+				c_cols_(a, b - j) = (a == b) + v_dot(a, p_.col(b));
+				qp_(a, b) = q_.col(a).dot(p_.col(b));
+			}
+		}
+		for (int b = 0; b < j; ++b)
+		{
+			for (int a = j; a < j + count; ++a)
+			{
+				c_rows_(a - j, b) = v_dot(a, p_.col(b));
+				qp_(a, b) = q_.col(a).dot(p_.col(b));
+			}
+		}
+
+		// Border C^-1 through the Schur complement S = C22 - C21 C11^-1 C12,
+		// whose determinant is det(A') / det(A)
+		auto c11_inverse = c_inverse_.topLeftCorner(j, j);
+		auto x = x_.topLeftCorner(j, count);
+		auto y = y_.topLeftCorner(count, j);
+		x.noalias() = c11_inverse * c_cols_.topLeftCorner(j, count);
+		y.noalias() = c_rows_.topLeftCorner(count, j) * c11_inverse;
+		schur_t s = c_cols_.block(j, 0, count, count);
+		s.noalias() -= c_rows_.topLeftCorner(count, j) * x;
+		if (!(std::abs(s.determinant()) >= singular_tolerance_))
+		{
+			return false;
+		}
+
+		// C^-1 = [C11^-1 + X S^-1 Y, -X S^-1; -S^-1 Y, S^-1], bounded entrywise
+		// before it is written so a rejected update leaves C^-1 as it was
+		schur_t s_inverse = s.inverse();
+		auto x_s = x_s_.topLeftCorner(j, count);
+		x_s.noalias() = x * s_inverse;
+		auto s_inverse_y = y_s_.topLeftCorner(count, j);
+		s_inverse_y.noalias() = s_inverse * y;
+		auto c_max = s_inverse.cwiseAbs().maxCoeff();
+		if (j > 0)
+		{
+			auto x_s_max = x_s.cwiseAbs().maxCoeff();
+			c_max = std::max({ c_max, x_s_max, s_inverse_y.cwiseAbs().maxCoeff(), c11_inverse.cwiseAbs().maxCoeff() + count * x_s_max * y.cwiseAbs().maxCoeff() });
+		}
+		if (base_max_ < 0)
+		{
+			base_max_ = base_.cwiseAbs().maxCoeff();
+		}
+		if (!(c_max * p_max_.head(j + count).maxCoeff() * q_max_.head(j + count).maxCoeff() <= growth_limit_ * base_max_))
+		{
+			return false;
+		}
+		c11_inverse.noalias() += x_s * y;
+		c_inverse_.block(0, j, j, count) = -x_s;
+		c_inverse_.block(j, 0, count, j) = -s_inverse_y;
+		c_inverse_.block(j, j, count, count) = s_inverse;
+		rank_ += count;
+		materialized_ = false;
+		c_inverse_q_valid_ = false;
+		if (rank_ >= max_rank_)
+		{
+			fold();
+		}
+		return true;
+	}
+
+	// C^-1 Q into c_inverse_q_, in O(k r^2) once per update
+	void correct_columns() const
+	{
+		if (!c_inverse_q_valid_)
+		{
+			c_inverse_q_.topRows(rank_).noalias() = c_inverse_.topLeftCorner(rank_, rank_) * q_.leftCols(rank_).transpose();
+			c_inverse_q_valid_ = true;
+		}
+	}
+
+	// target -= P C^-1 Q
+	void subtract_correction(Eigen::MatrixXd& target) const
+	{
+		correct_columns();
+		target.noalias() -= p_.leftCols(rank_) * c_inverse_q_.topRows(rank_);
+	}
+
+	// C^-1 Q e_c into work_
+	void correct_column(int c) const
+	{
+		work_.head(rank_).noalias() = c_inverse_.topLeftCorner(rank_, rank_) * q_.row(c).head(rank_).transpose();
+	}
+
+public:
+	// Fold once max_rank terms are pending, at least 2 so a swap fits
+	explicit factored_inverse_t(int max_rank = 16)
+		:
+	max_rank_(max_rank)
+	{
+		if (max_rank < 2)
+		{
+			throw std::invalid_argument("factored_inverse_t: max_rank must be at least 2");
+		}
+	}
+
+	// The inverse B with no corrections
+	factored_inverse_t(const Eigen::MatrixXd& inverse, int max_rank = 16)
+		:
+	factored_inverse_t(max_rank)
+	{
+		resize(static_cast<int>(inverse.rows()));
+		base_ = inverse;
+	}
+
+	// Size for k x k inverses, dropping any corrections. The base is left for
+	// the caller to fill in through base().
+	void resize(int k)
+	{
+		auto m = max_rank_ + 1;
+		base_.resize(k, k);
+		u_unit_.resize(m);
+		v_unit_.resize(m);
+		u_.resize(k, m);
+		v_.resize(k, m);
+		p_.resize(k, m);
+		q_.resize(k, m);
+		c_inverse_.resize(m, m);
+		qp_.resize(m, m);
+		c_cols_.resize(m, 2);
+		c_rows_.resize(2, m);
+		x_.resize(m, 2);
+		y_.resize(2, m);
+		x_s_.resize(m, 2);
+		y_s_.resize(2, m);
+		p_max_.resize(m);
+		q_max_.resize(m);
+		c_inverse_q_.resize(m, k);
+		work_.resize(m);
+		work2_.resize(m);
+		inverse_.resize(k, k);
+		clear();
+	}
+
+	// The base inverse B. Writing to it invalidates the corrections, so call
+	// clear() after.
+	Eigen::MatrixXd& base()
+	{
+		return base_;
+	}
+
+	const Eigen::MatrixXd& base() const
+	{
+		return base_;
+	}
+
+	// Drop the corrections, leaving the base
+	void clear()
+	{
+		rank_ = 0;
+		base_max_ = -1;
+		materialized_ = false;
+		c_inverse_q_valid_ = false;
+	}
+
+	// Smallest |det S| of an update, the ratio of determinants across it, for
+	// which it is applied; see basic_sherman_engine_t
+	void set_singular_tolerance(double tolerance)
+	{
+		singular_tolerance_ = tolerance;
+	}
+
+	// Largest growth max|P| max|C^-1| max|Q| / max|B| of the correction for
+	// which an update is applied. |det S| alone is blind to scale: on mains that
+	// are not diagonally dominant an update can pass it and still leave a
+	// correction whose cancellation against B, and whose amplification of the
+	// rounding errors in B, cost several digits. The default of 1e4 keeps the
+	// accuracy near that of rank-1 updates; on random mains it rejects 5 to 10%
+	// of swaps, on diagonally dominant ones none.
+	void set_growth_limit(double limit)
+	{
+		growth_limit_ = limit;
+	}
+
+	// The updates below return false, leaving the inverse unchanged, if the
+	// updated matrix would be near singular or the correction grow too far.
+
+	// A + u v
+	template<class U, class V>
+	bool update(const U& u, const V& v)
+	{
+		u_unit_[rank_] = -1;
+		v_unit_[rank_] = -1;
+		u_.col(rank_) = u;
+		v_.col(rank_) = v.transpose();
+		return border(1);
+	}
+
+	// A with v added to row r, i.e. u = e_r
+	template<class V>
+	bool update_row(int r, const V& v)
+	{
+		u_unit_[rank_] = r;
+		v_unit_[rank_] = -1;
+		v_.col(rank_) = v.transpose();
+		return border(1);
+	}
+
+	// A with u added to column c, i.e. v = e_c
+	template<class U>
+	bool update_col(int c, const U& u)
+	{
+		u_unit_[rank_] = -1;
+		v_unit_[rank_] = c;
+		u_.col(rank_) = u;
+		return border(1);
+	}
+
+	// A + e_s v + u e_s^T as one rank-2 update, which avoids the intermediate
+	// matrix of a row then a column update, e.g. the operands of gather_swap
+	template<class V, class U>
+	bool update_swap(int slot, const V& v, const U& u)
+	{
+		u_unit_[rank_] = slot;
+		v_unit_[rank_] = -1;
+		v_.col(rank_) = v.transpose();
+		u_unit_[rank_ + 1] = -1;
+		v_unit_[rank_ + 1] = slot;
+		u_.col(rank_ + 1) = u;
+		return border(2);
+	}
+
+	// Apply the corrections to the base
+	void fold()
+	{
+		if (rank_ == 0)
+		{
+			return;
+		}
+		subtract_correction(base_);
+		++folds_;
+		clear();
+	}
+
+	// Number of terms pending, and of folds so far
+	int rank() const
+	{
+		return rank_;
+	}
+
+	int64_t folds() const
+	{
+		return folds_;
+	}
+
+	int rows() const
+	{
+		return static_cast<int>(base_.rows());
+	}
+
+	// Entry (r, c), in O(r) if diagonal() or materialize() was called since the
+	// last update, else O(r^2)
+	double coeff(int r, int c) const
+	{
+		if (c_inverse_q_valid_)
+		{
+			return base_(r, c) - p_.row(r).head(rank_).dot(c_inverse_q_.col(c).head(rank_));
+		}
+		correct_column(c);
+		return base_(r, c) - p_.row(r).head(rank_).dot(work_.head(rank_));
+	}
+
+	double operator()(int r, int c) const
+	{
+		return coeff(r, c);
+	}
+
+	// The diagonal into diagonal, which must have rows() entries, in O(k r^2)
+	// for C^-1 Q and then O(k r)
+	template<class Vector>
+	void diagonal(Vector& diagonal) const
+	{
+		diagonal = base_.diagonal();
+		if (rank_ == 0)
+		{
+			return;
+		}
+		correct_columns();
+		for (Eigen::Index i = 0; i < diagonal.size(); ++i)
+		{
+			diagonal[i] -= p_.row(i).head(rank_).dot(c_inverse_q_.col(i).head(rank_));
+		}
+	}
+
+	// trace(B) - trace(C^-1 Q P), in O(k + r^2)
+	double trace() const
+	{
+		return base_.trace() - c_inverse_.topLeftCorner(rank_, rank_).cwiseProduct(qp_.topLeftCorner(rank_, rank_).transpose()).sum();
+	}
+
+	// x = A^-1 b, in O(k^2). b and x must not alias.
+	template<class B, class X>
+	void solve(const B& b, X& x) const
+	{
+		x.noalias() = base_ * b;
+		work_.head(rank_).noalias() = q_.leftCols(rank_).transpose() * b;
+		work2_.head(rank_).noalias() = c_inverse_.topLeftCorner(rank_, rank_) * work_.head(rank_);
+		x.noalias() -= p_.leftCols(rank_) * work2_.head(rank_);
+	}
+
+	// The full inverse, formed on first use after an update at the cost of a fold
+	const Eigen::MatrixXd& materialize() const
+	{
+		if (rank_ == 0)
+		{
+			return base_;
+		}
+		if (!materialized_)
+		{
+			inverse_ = base_;
+			subtract_correction(inverse_);
+			materialized_ = true;
+		}
+		return inverse_;
+	}
+};
+
+// sherman_morrison_update_inverse for a factored inverse: (A+uv)^-1 as a new
+// correction rather than a k x k update, so callers written against the dense
+// form keep working. As there, a singular result is not detected: the update
+// falls back to the dense formula on the materialized inverse.
+//
+// inv is taken by value and updated in place. Passing an lvalue copies the
+// whole object, base and workspace, so callers that no longer need it should
+// move it in, and loops should call update() on one object instead.
+inline factored_inverse_t sherman_morrison_update_inverse(factored_inverse_t inv, const Eigen::VectorXd& u, const Eigen::RowVectorXd& v)
+{
+	if (!inv.update(u, v))
+	{
+		Eigen::MatrixXd updated = sherman_morrison_update_inverse(inv.materialize(), u, v);
+		inv.base() = std::move(updated);
+		inv.clear();
+	}
+	return inv;
+}
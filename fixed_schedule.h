@@ -0,0 +1,262 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <utility>
+#include "eigen/Dense"
+
+#include "alloc.h"
+#include "gray.h"
+#include "matrix.h"
+#include "schedule.h"
+
+// Swap schedules for group shapes known at compile time. The same walk as
+// make_schedule runs in a constant expression, so the swaps are a constexpr
+// std::array and an engine can be unrolled over them with every slot and item
+// a constant. Shape lists size, pick pairs outermost first, as in make_schedule.
+// Constant evaluation is slow, so this is meant for small shapes such as the
+// benchmark's 4C3 x 7C4; larger ones belong in a runtime schedule_t.
+
+template<int... Shape>
+struct fixed_shape_t
+{
+	static_assert(sizeof...(Shape) % 2 == 0, "shapes are size, pick pairs");
+	static constexpr int group_count = sizeof...(Shape) / 2;
+	static constexpr std::array<int, sizeof...(Shape)> shape = { Shape... };
+
+	static constexpr int size()
+	{
+		auto size = 0;
+		for (int g = 0; g < group_count; ++g)
+		{
+			size += shape[2 * g];
+		}
+		return size;
+	}
+
+	static constexpr int comb_size()
+	{
+		auto comb_size = 0;
+		for (int g = 0; g < group_count; ++g)
+		{
+			comb_size += shape[2 * g + 1];
+		}
+		return comb_size;
+	}
+
+	static constexpr int64_t combinations()
+	{
+		int64_t combinations = 1;
+		for (int g = 0; g < group_count; ++g)
+		{
+			combinations *= binomial(shape[2 * g], shape[2 * g + 1]);
+		}
+		return combinations;
+	}
+};
+
+// The initial selection and every swap of a fixed shape
+template<class Shape>
+struct fixed_schedule_t
+{
+	std::array<int, Shape::comb_size()> initial{};
+	std::array<swap_t, Shape::combinations() - 1> swaps{};
+};
+
+template<class Shape, size_t... G>
+constexpr std::array<gray_generator_t, Shape::group_count> fixed_generators(std::index_sequence<G...>)
+{
+	return { gray_generator_t(Shape::shape[2 * G], Shape::shape[2 * G + 1])... };
+}
+
+// make_schedule as a constant expression
+template<class Shape>
+constexpr fixed_schedule_t<Shape> make_fixed_schedule()
+{
+	const auto groups = Shape::group_count;
+	fixed_schedule_t<Shape> schedule;
+	auto generators = fixed_generators<Shape>(std::make_index_sequence<groups>());
+	std::array<int, groups> offsets{};
+	std::array<int64_t, groups> strides{};
+	int64_t combinations = 1;
+	auto offset = 0;
+	for (auto g = groups; g-- > 0;)
+	{
+		offsets[g] = offset;
+		strides[g] = combinations;
+		offset += Shape::shape[2 * g];
+		combinations *= binomial(Shape::shape[2 * g], Shape::shape[2 * g + 1]);
+	}
+
+	std::array<int, Shape::size()> main_to_comb{};
+	auto count = 0;
+	for (auto g = groups; g-- > 0;)
+	{
+		auto value = generators[g].value();
+		for (auto i = 0; i < Shape::shape[2 * g]; ++i)
+		{
+			main_to_comb[offsets[g] + i] = -1;
+			if (value >> i & 1)
+			{
+				main_to_comb[offsets[g] + i] = count;
+				schedule.initial[count++] = offsets[g] + i;
+			}
+		}
+	}
+
+	for (int64_t n = 1; n < combinations; ++n)
+	{
+		swap_t swap = { -1, -1, -1 };
+		for (int g = 0; g < groups; ++g)
+		{
+			if (n % strides[g] != 0)
+			{
+				continue;
+			}
+			auto value = generators[g].value();
+			generators[g].next();
+			auto value_next = generators[g].value();
+			if (value != value_next)
+			{
+				swap.removed = offsets[g] + set_bit(value & ~value_next);
+				swap.added = offsets[g] + set_bit(value_next & ~value);
+			}
+		}
+		swap.slot = main_to_comb[swap.removed];
+		main_to_comb[swap.removed] = -1;
+		main_to_comb[swap.added] = swap.slot;
+		schedule.swaps[n - 1] = swap;
+	}
+	return schedule;
+}
+
+// The Sherman-Morrison engine for a fixed shape. Matrices are fixed-size, so
+// Eigen unrolls the row/column arithmetic, and run() is unrolled over the whole
+// swap table, so every step's slot and items are compile-time constants. There
+// is no singular-swap handling; see sherman_engine_t for that.
+template<int... Shape>
+class fixed_sherman_t
+{
+public:
+	typedef fixed_shape_t<Shape...> shape_t;
+	static constexpr int K = shape_t::comb_size();
+	static constexpr fixed_schedule_t<shape_t> schedule = make_fixed_schedule<shape_t>();
+
+	typedef Eigen::Matrix<double, K, K> matrix_t;
+	typedef Eigen::Matrix<double, 1, K> row_t;
+	typedef Eigen::Matrix<double, K, 1> col_t;
+
+private:
+	main_matrix_t main_;
+	int64_t rank_ = 0;
+	std::array<int, K> comb_to_main_;
+	matrix_t combination_;
+	matrix_t inverse_;
+
+	// Replacement row/column, update vectors and workspace
+	row_t new_row_;
+	col_t new_col_;
+	row_t v_row_;
+	col_t u_col_;
+	col_t work_col_;
+	row_t work_row_;
+
+	template<size_t I, class Visit>
+	void unrolled_step(Visit& visit)
+	{
+		constexpr auto swap = schedule.swaps[I];
+		apply(swap.added, swap.slot);
+		++rank_;
+		visit(*this);
+	}
+
+	template<class Visit, size_t... I>
+	void unrolled(Visit& visit, std::index_sequence<I...>)
+	{
+		(unrolled_step<I>(visit), ...);
+	}
+
+	void apply(int added, int slot)
+	{
+		comb_to_main_[slot] = added;
+		row_map(main_, added, comb_to_main_, new_row_);
+		col_map(main_, added, comb_to_main_, new_col_);
+		v_row_ = new_row_ - combination_.row(slot);
+		combination_.row(slot) = new_row_;
+		sherman_morrison_update_row(inverse_, slot, v_row_, work_col_, work_row_);
+		u_col_ = new_col_ - combination_.col(slot);
+		combination_.col(slot) = new_col_;
+		sherman_morrison_update_col(inverse_, slot, u_col_, work_col_, work_row_);
+	}
+
+public:
+	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+	static const bool allocates_in_step = false;
+
+	// main must be shape_t::size() square
+	explicit fixed_sherman_t(const main_matrix_t& main)
+		:
+	main_(main)
+	{
+	}
+
+	void seed(int64_t rank)
+	{
+		comb_to_main_ = schedule.initial;
+		for (int64_t n = 0; n < rank; ++n)
+		{
+			comb_to_main_[schedule.swaps[n].slot] = schedule.swaps[n].added;
+		}
+		rank_ = rank;
+		for (int c = 0; c < K; ++c)
+		{
+			for (int r = 0; r < K; ++r)
+			{
+				combination_(r, c) = main_(comb_to_main_[r], comb_to_main_[c]);
+			}
+		}
+		inverse_ = combination_.inverse();
+	}
+
+	void step()
+	{
+		const auto& swap = schedule.swaps[rank_];
+		++rank_;
+		apply(swap.added, swap.slot);
+	}
+
+	// Visit every combination, with the steps unrolled over the swap table
+	template<class Visit>
+	void run(Visit&& visit)
+	{
+		seed(0);
+		visit(*this);
+		no_alloc_scope_t scope;
+		unrolled(visit, std::make_index_sequence<schedule.swaps.size()>());
+	}
+
+	int64_t rank() const
+	{
+		return rank_;
+	}
+
+	int comb_size() const
+	{
+		return K;
+	}
+
+	static constexpr int64_t combinations()
+	{
+		return shape_t::combinations();
+	}
+
+	const std::array<int, K>& comb_to_main() const
+	{
+		return comb_to_main_;
+	}
+
+	const matrix_t& inverse() const
+	{
+		return inverse_;
+	}
+};
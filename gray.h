@@ -2,7 +2,7 @@
 #include <cstdint>
 
 // count number of bits set in x
-inline uint32_t count_bits(uint32_t x)
+constexpr uint32_t count_bits(uint32_t x)
 {
 	uint32_t count = 0;
 	for (; x; x >>= 1)
@@ -13,7 +13,7 @@ inline uint32_t count_bits(uint32_t x)
 }
 
 // Index of most significant set bit in x
-inline int set_bit(uint32_t x)
+constexpr int set_bit(uint32_t x)
 {
 	uint32_t r = 0;
 	while (x >>= 1)
@@ -24,7 +24,7 @@ inline int set_bit(uint32_t x)
 }
 
 // Factorial of x
-inline uint32_t fact(uint32_t x)
+constexpr uint32_t fact(uint32_t x)
 {
 	uint32_t f = 1;
 	for(; x > 1; --x)
@@ -34,10 +34,26 @@ inline uint32_t fact(uint32_t x)
 	return f;
 }
 
+// Number of ways to pick k items from n
+constexpr uint64_t binomial(uint32_t n, uint32_t k)
+{
+	if (k > n)
+	{
+		return 0;
+	}
+	uint64_t b = 1;
+	for (uint32_t i = 1; i <= k; ++i)
+	{
+		b = b * (n - k + i) / i;
+	}
+	return b;
+}
+
 // Generates Gray Code sequences of length size with pick bits set,
 // suitable for combinations. Each successive value has a Hamming
 // distance of 2 from the previous value which corresponds to replacing
-// one item in a combination with a different item.
+// one item in a combination with a different item. Usable in constant
+// expressions, see fixed_schedule.h.
 class gray_generator_t
 {
 	int size_;
@@ -46,25 +62,25 @@ class gray_generator_t
 	uint32_t index_;
 	int combinations_;
 public:
-	gray_generator_t(int size, int pick)
+	constexpr gray_generator_t(int size, int pick)
 		: 
 	size_(size), 
 	pick_(pick), 
 	reversed_(false),
 	index_(0),
-	combinations_(fact(size) / (fact(pick) * fact(size-pick)))
+	combinations_(static_cast<int>(binomial(size, pick)))
 	{
 		next();
 	}
 
 	// Binary to Gray Code
-	static uint32_t gray(uint32_t x)
+	static constexpr uint32_t gray(uint32_t x)
 	{
 		return x ^ (x >> 1);
 	}
 
 	// Advance to the next Code. At the end, the sequence is replayed in reverse.
-	void next()
+	constexpr void next()
 	{
 		auto next_index = index_;
 		if (reversed_)
@@ -77,7 +93,7 @@ public:
 					reversed_ = false;
 					break;
 				}
-				if (count_bits(gray(next_index)) == pick_)
+				if (count_bits(gray(next_index)) == static_cast<uint32_t>(pick_))
 				{
 					index_ = next_index;
 					break;
@@ -89,12 +105,12 @@ public:
 			for (;;)
 			{
 				++next_index;
-				if (next_index == 1 << size_)
+				if (next_index == 1u << size_)
 				{
 					reversed_ = true;
 					break;
 				}
-				if (count_bits(gray(next_index)) == pick_)
+				if (count_bits(gray(next_index)) == static_cast<uint32_t>(pick_))
 				{
 					index_ = next_index;
 					break;
@@ -105,19 +121,19 @@ public:
 	}
 
 	// The current Gray code
-	uint32_t value() const
+	constexpr uint32_t value() const
 	{
 		return gray(index_);
 	}
 
 	// The size of the set being selected from
-	int size() const
+	constexpr int size() const
 	{
 		return size_;
 	}
 
 	// Length of the sequence that this will generate
-	int combinations() const
+	constexpr int combinations() const
 	{
 		return combinations_;
 	}
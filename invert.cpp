@@ -4,11 +4,119 @@
 #include <bitset>
 #include <array>
 #include <thread>
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <numeric>
+#include <string>
+#include <omp.h>
 #include "eigen/Dense"
 
 #include "gray.h"
 #include "matrix.h"
 #include "benchmark.h"
+#include "lockstep.h"
+#include "schedule.h"
+#include "sherman.h"
+#include "enumerate.h"
+#include "sweep.h"
+#include "baseline.h"
+#include "alloc.h"
+#include "phase.h"
+#include "bnb.h"
+#include "checkpoint.h"
+#include "shard.h"
+#include "invert_api.h"
+#include "ridge.h"
+#include "fixed_schedule.h"
+#include "block.h"
+#include "cross.h"
+#include "delayed.h"
+#include "stream.h"
+#include "tiled.h"
+#include "numa.h"
+#include "service.h"
+#include "writer.h"
+
+// Allocation hooks feeding alloc.h. On glibc malloc itself is interposed, because
+// Eigen allocates its matrices with std::malloc rather than operator new, and
+// operator new goes straight to glibc so nothing is counted twice.
+#if defined(__GLIBC__)
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* p, size_t size);
+extern "C" void __libc_free(void* p);
+
+extern "C" void* malloc(size_t size)
+{
+	count_allocation(size);
+	return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size)
+{
+	count_allocation(count * size);
+	return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* p, size_t size)
+{
+	count_allocation(size);
+	return __libc_realloc(p, size);
+}
+
+static void* raw_malloc(size_t size)
+{
+	return __libc_malloc(size);
+}
+
+static void raw_free(void* p)
+{
+	__libc_free(p);
+}
+#else
+static void* raw_malloc(size_t size)
+{
+	return std::malloc(size);
+}
+
+static void raw_free(void* p)
+{
+	std::free(p);
+}
+#endif
+
+void* operator new(size_t size)
+{
+	count_allocation(size);
+	if (auto p = raw_malloc(size ? size : 1))
+	{
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+// Every delete goes through raw_free, the pair of raw_malloc, so the compiler
+// sees matching allocation functions rather than free on operator new's memory
+void operator delete(void* p) noexcept
+{
+	raw_free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	raw_free(p);
+}
+
+// Swap schedule for the benchmark's groups, 4C3 x 7C4, shared by every engine below
+const schedule_t& benchmark_schedule()
+{
+	static const auto schedule = make_schedule({ {4, 3}, {7, 4} });
+	return *schedule;
+}
 
 // A single threaded naive approach that computes the inverse for every combination
 bool eigen_random()
@@ -50,9 +158,7 @@ bool eigen_sherman()
 
 	const auto size = 11;
 	const auto select_large = 4;
-	const auto size_large = 7;
 	const auto select_small = 3;
-	const auto size_small = 4;
 	const auto comb_size = select_small + select_large;
 	
 	// Matrix for all items
@@ -62,9 +168,6 @@ bool eigen_sherman()
 	gray_join_t gray;
 	std::bitset<size> selected = gray.next();
 
-	// Matrix for this combination
-	Eigen::MatrixXd combination(size_large, size_large);
-
 	// Maps index into main matrix onto an index into the combination matrix
 	// and its inverse
 	std::array<int, 11> main_to_comb;
@@ -85,68 +188,76 @@ bool eigen_sherman()
 		}
 	}
 
-	// Generate the initial combination
-	auto ci = 0;
-	for (size_t i = 0; i < selected.size(); ++i)
-	{
-		auto cj = 0;
-		for (size_t j = 0; j < selected.size(); ++j)
-		{
-			if (selected[i] && selected[j]) {
-				combination(ci, cj) = main(i, j);
-				cj++;
-			}
-		}
-		if (selected[i])
-		{
-			ci++;
-		}
-	}
-
-	// Compute the inverse of the initial combination directly
-	Eigen::MatrixXd inverse = combination.inverse();
+	// Compute the inverse of the initial combination directly. The combination
+	// matrix is never stored, only read from main through comb_to_main.
+	Eigen::MatrixXd inverse = indexed_view(main, comb_to_main, comb_to_main).inverse();
 	
 	// From now on, update the inverse using two rank-2 updates, to replace a row and column
 	for (int n = 1; n < 35*4; ++n)
 	{
 		// Generate the next combination by removing one item and adding another
-		uint32_t selected_next = gray.next();
-	
-		// Index into main matrix of removed item
-		uint32_t removed = set_bit(selected.to_ulong() &~selected_next);
+		uint32_t selected_next;
+		uint32_t removed;
+		uint32_t added;
+		{
+			PHASE_SCOPE(phase_gray);
+			selected_next = gray.next();
+		
+			// Index into main matrix of removed item
+			removed = set_bit(selected.to_ulong() &~selected_next);
 
-		// Index into main matrix of added item
-		uint32_t added = set_bit(selected_next & ~selected.to_ulong());
+			// Index into main matrix of added item
+			added = set_bit(selected_next & ~selected.to_ulong());
+		}
 
 		// Index into combination matrix of row/column to swap
 		auto comb_swap_index = main_to_comb[removed];
 	
 		// Update the mapping between the main matrix and the combination
-		main_to_comb[removed] = -1;
-		main_to_comb[added] = comb_swap_index;
-		comb_to_main[comb_swap_index] = added;
+		{
+			PHASE_SCOPE(phase_mapping);
+			main_to_comb[removed] = -1;
+			main_to_comb[added] = comb_swap_index;
+			comb_to_main[comb_swap_index] = added;
+		}
 
 		// Replacement row and column
-		auto new_row = row_map(main, added, comb_to_main);
-		auto new_col = col_map(main, added, comb_to_main);
+		Eigen::RowVectorXd new_row;
+		Eigen::VectorXd new_col;
+		{
+			PHASE_SCOPE(phase_gather);
+			new_row = row_map(main, added, comb_to_main);
+			new_col = col_map(main, added, comb_to_main);
+		}
 
-		// Sherman-Morrison u, v vectors for row replacement
-		auto u_row = Eigen::VectorXd::Unit(comb_size, comb_swap_index);
-		Eigen::RowVectorXd v_row = new_row - combination.row(comb_swap_index);
+		{
+			PHASE_SCOPE(phase_row_update);
 
-		// Update the combination matrix and its inverse for the row replacement
-		combination.row(comb_swap_index) = new_row;
-		inverse = sherman_morrison_update_inverse(inverse, u_row, v_row);
+			// Sherman-Morrison u, v vectors for row replacement
+			auto u_row = Eigen::VectorXd::Unit(comb_size, comb_swap_index);
+			// The old row has the removed item back in the swapped slot
+			Eigen::RowVectorXd v_row = new_row - indexed_view(main, single_index_t{ static_cast<int>(removed) }, replaced_index(comb_to_main, comb_swap_index, removed));
 
-		// Vectors for row replacement
-		Eigen::VectorXd u_col = new_col - combination.col(comb_swap_index);
-		auto v_col = Eigen::RowVectorXd::Unit(comb_size, comb_swap_index);
-		
-		// Update the combination matrix and its inverse for the column replacement
-		combination.col(comb_swap_index) = new_col;
-		inverse = sherman_morrison_update_inverse(inverse, u_col, v_col);
+			// Update the inverse for the row replacement
+			inverse = sherman_morrison_update_inverse(inverse, u_row, v_row);
+		}
 
-		success = success && inverse.allFinite();
+		{
+			PHASE_SCOPE(phase_col_update);
+
+			// Vectors for row replacement
+			Eigen::VectorXd u_col = new_col - indexed_view(main, comb_to_main, single_index_t{ static_cast<int>(removed) });
+			u_col[comb_swap_index] = 0;
+			auto v_col = Eigen::RowVectorXd::Unit(comb_size, comb_swap_index);
+			
+			// Update the inverse for the column replacement
+			inverse = sherman_morrison_update_inverse(inverse, u_col, v_col);
+		}
+
+		{
+			PHASE_SCOPE(phase_finite);
+			success = success && inverse.allFinite();
+		}
 
 		selected = selected_next;
 	}
@@ -154,21 +265,918 @@ bool eigen_sherman()
 	return success;
 }
 
-int main()
+// Same update scheme as eigen_sherman, but iterates a precomputed schedule instead
+// of deriving each swap from the Gray code, and updates the inverse in place.
+bool eigen_sherman_schedule()
+{
+	const auto& schedule = benchmark_schedule();
+	Eigen::MatrixXd main = Eigen::MatrixXd::Random(schedule.size(), schedule.size());
+
+	sherman_engine_t engine(main, schedule);
+	auto success = true;
+	enumerate_range(engine, 0, schedule.combinations(), [&](const sherman_engine_t& e)
+	{
+		PHASE_SCOPE(phase_finite);
+		success = success && e.inverse().allFinite();
+	});
+	return success;
+}
+
+// eigen_sherman_schedule with the gathers done ahead on a producer thread, see
+// stream.h. The benchmark matrix fits in L1, so this measures the hand-off.
+bool eigen_sherman_stream()
+{
+	const auto& schedule = benchmark_schedule();
+	Eigen::MatrixXd main = Eigen::MatrixXd::Random(schedule.size(), schedule.size());
+
+	streamed_sherman_engine_t engine(main, schedule);
+	auto success = true;
+	enumerate_range(engine, 0, schedule.combinations(), [&](const streamed_sherman_engine_t& e)
+	{
+		PHASE_SCOPE(phase_finite);
+		success = success && e.inverse().allFinite();
+	});
+	return success;
+}
+
+// The benchmark's shape with its swap table built at compile time and the whole
+// enumeration unrolled over it, see fixed_schedule.h
+bool eigen_sherman_fixed()
+{
+	typedef fixed_sherman_t<4, 3, 7, 4> engine_t;
+	Eigen::MatrixXd main = Eigen::MatrixXd::Random(engine_t::shape_t::size(), engine_t::shape_t::size());
+
+	engine_t engine(main);
+	auto success = true;
+	engine.run([&](const engine_t& e)
+	{
+		PHASE_SCOPE(phase_finite);
+		success = success && e.inverse().allFinite();
+	});
+	return success;
+}
+
+// Non-principal combinations A[R, C], with R from the benchmark shape and C 7 of
+// 8 columns, so each step replaces only a row or a column, see cross.h
+bool eigen_sherman_cross()
+{
+	static const cross_schedule_t schedule(make_schedule({ {4, 3}, {7, 4} }), make_schedule({ {8, 7} }));
+	Eigen::MatrixXd main = Eigen::MatrixXd::Random(schedule.rows().size(), schedule.cols().size());
+
+	cross_sherman_engine_t engine(main, schedule);
+	auto success = true;
+	enumerate_range(engine, 0, schedule.combinations(), [&](const cross_sherman_engine_t& e)
+	{
+		PHASE_SCOPE(phase_finite);
+		success = success && e.inverse().allFinite();
+	});
+	return success;
+}
+
+// eigen_sherman_schedule with the updates of every 8 swaps applied together,
+// reading only the trace of each inverse, through the factored form. The main
+// is not diagonally dominant, so every 64th trace is also checked against a
+// direct inversion to 1e-6 of the inverse's largest entries.
+bool eigen_sherman_delayed()
+{
+	const auto& schedule = benchmark_schedule();
+	Eigen::MatrixXd main = Eigen::MatrixXd::Random(schedule.size(), schedule.size());
+
+	delayed_sherman_engine_t engine(main, schedule);
+	auto k = schedule.comb_size();
+	Eigen::PartialPivLU<Eigen::MatrixXd> lu(k);
+	Eigen::MatrixXd reference(k, k);
+	auto success = true;
+	enumerate_range(engine, 0, schedule.combinations(), [&](const delayed_sherman_engine_t& e)
+	{
+		PHASE_SCOPE(phase_finite);
+		auto trace = e.factored().trace();
+		success = success && std::isfinite(trace);
+		if (e.rank() % 64 == 0)
+		{
+			lu.compute(indexed_view(main, e.comb_to_main(), e.comb_to_main()));
+			if (lu_inverse(lu, reference))
+			{
+				success = success && std::abs(trace - reference.trace()) <= 1e-6 * k * reference.cwiseAbs().maxCoeff();
+			}
+		}
+	});
+	return success;
+}
+
+// eigen_sherman_schedule tracking the condition of every combination, re-anchoring
+// with a direct inversion when it falls below 1e-8
+bool eigen_sherman_condition()
+{
+	const auto& schedule = benchmark_schedule();
+	Eigen::MatrixXd main = Eigen::MatrixXd::Random(schedule.size(), schedule.size());
+
+	sherman_engine_t engine(main, schedule);
+	engine.track_condition(1e-8);
+	auto success = true;
+	auto min_rcond = 1.0;
+	enumerate_range(engine, 0, schedule.combinations(), [&](const sherman_engine_t& e)
+	{
+		PHASE_SCOPE(phase_finite);
+		min_rcond = std::min(min_rcond, e.rcond());
+		success = success && e.inverse().allFinite();
+	});
+	return success && min_rcond > 0;
+}
+
+// Symmetric positive definite main matrix and a log-spaced grid of 32 ridge
+// parameters for the ridge benchmarks
+Eigen::MatrixXd ridge_main(int size)
+{
+	Eigen::MatrixXd r = Eigen::MatrixXd::Random(size, size);
+	return r * r.transpose() + Eigen::MatrixXd::Identity(size, size);
+}
+
+const std::vector<double>& ridge_lambdas()
+{
+	static const auto lambdas = []()
+	{
+		std::vector<double> lambdas;
+		for (int l = 0; l < 32; ++l)
+		{
+			lambdas.push_back(std::pow(10.0, -4 + l * 6.0 / 31));
+		}
+		return lambdas;
+	}();
+	return lambdas;
+}
+
+// Traces and solves of (A_S + lambda I)^-1 for every ridge parameter, inverting
+// each regularised combination directly
+bool ridge_inverse()
+{
+	const auto& schedule = benchmark_schedule();
+	const auto& lambdas = ridge_lambdas();
+	auto main = ridge_main(schedule.size());
+	Eigen::VectorXd b = Eigen::VectorXd::Ones(schedule.comb_size());
+
+	auto success = true;
+	auto selection = schedule.initial();
+	for (int64_t rank = 0; rank < schedule.combinations(); ++rank)
+	{
+		if (rank > 0)
+		{
+			const auto& swap = schedule[rank - 1];
+			selection[swap.slot] = swap.added;
+		}
+		auto combination = sub_matrix(main, selection);
+		for (auto lambda : lambdas)
+		{
+			Eigen::MatrixXd inverse = (combination + lambda * Eigen::MatrixXd::Identity(combination.rows(), combination.cols())).inverse();
+			Eigen::VectorXd x = inverse * b;
+			success = success && std::isfinite(inverse.trace()) && x.allFinite();
+		}
+	}
+	return success;
+}
+
+// The same from one eigendecomposition per combination, see ridge.h
+bool ridge_eigen()
+{
+	const auto& schedule = benchmark_schedule();
+	const auto& lambdas = ridge_lambdas();
+	auto main = ridge_main(schedule.size());
+	Eigen::VectorXd b = Eigen::VectorXd::Ones(schedule.comb_size());
+	Eigen::RowVectorXd traces(lambdas.size());
+	Eigen::MatrixXd x(schedule.comb_size(), lambdas.size());
+
+	ridge_engine_t engine(main, schedule, lambdas);
+	auto success = true;
+	enumerate_range(engine, 0, schedule.combinations(), [&](const ridge_engine_t& e)
+	{
+		e.traces(traces);
+		e.solve(b, x);
+		success = success && traces.allFinite() && x.allFinite();
+	});
+	return success;
+}
+
+// The same enumeration through the library's public interface, to measure what
+// a caller linking the library gets, including the cost of the visit callback
+bool eigen_sherman_api()
+{
+	static const invert_enumerator_t enumerator({ {4, 3}, {7, 4} });
+	Eigen::MatrixXd main = Eigen::MatrixXd::Random(enumerator.size(), enumerator.size());
+
+	auto success = true;
+	enumerator.enumerate(main.data(), 0, enumerator.combinations(), [&](const invert_combination_t& combination)
+	{
+		PHASE_SCOPE(phase_finite);
+		success = success && Eigen::Map<const Eigen::MatrixXd>(combination.inverse, combination.size, combination.size).allFinite();
+	});
+	return success;
+}
+
+// Split the schedule into one contiguous range of combinations per thread. Each
+// thread computes the inverse at the start of its range directly and then uses
+// Sherman-Morrison updates, so there are no dependencies between threads.
+bool eigen_sherman_openmp()
+{
+	const auto& schedule = benchmark_schedule();
+	Eigen::MatrixXd main = Eigen::MatrixXd::Random(schedule.size(), schedule.size());
+
+	std::vector<char> finite(enumerate_threads(0), true);
+	enumerate_openmp<sherman_engine_t>(main, schedule, 0, [&](int thread, const sherman_engine_t& engine)
+	{
+		PHASE_SCOPE(phase_finite);
+		finite[thread] = finite[thread] && engine.inverse().allFinite();
+	});
+	return std::all_of(finite.begin(), finite.end(), [](char f) { return f; });
+}
+
+// Every inverse by the Schur complement of the last group's block, with the
+// block inverses in one block_cache_t shared by all threads, see block.h
+bool eigen_block_openmp()
+{
+	const auto& schedule = benchmark_schedule();
+	Eigen::MatrixXd main = Eigen::MatrixXd::Random(schedule.size(), schedule.size());
+
+	block_cache_t cache;
+	std::vector<char> finite(enumerate_threads(0), true);
+	#pragma omp parallel num_threads(static_cast<int>(finite.size()))
+	{
+		auto thread = omp_get_thread_num();
+		auto count = omp_get_num_threads();
+		block_engine_t engine(main, schedule, cache);
+		enumerate_range(engine, schedule.combinations() * thread / count, schedule.combinations() * (thread + 1) / count, [&](const block_engine_t& e)
+		{
+			PHASE_SCOPE(phase_finite);
+			finite[thread] = finite[thread] && e.inverse().allFinite();
+		});
+	}
+	return std::all_of(finite.begin(), finite.end(), [](char f) { return f; });
+}
+
+#ifdef __linux__
+// eigen_sherman_openmp with threads pinned by NUMA node and a copy of main and
+// the schedule on every node, see numa.h
+bool eigen_sherman_numa()
+{
+	static const auto topology = read_numa_topology();
+	const auto& schedule = benchmark_schedule();
+	Eigen::MatrixXd main = Eigen::MatrixXd::Random(schedule.size(), schedule.size());
+
+	std::vector<char> finite(enumerate_threads(0), true);
+	enumerate_numa<sherman_engine_t>(main, schedule, topology, 0, [&](int thread, const sherman_engine_t& engine)
+	{
+		PHASE_SCOPE(phase_finite);
+		finite[thread] = finite[thread] && engine.inverse().allFinite();
+	});
+	return std::all_of(finite.begin(), finite.end(), [](char f) { return f; });
+}
+
+// What the writer benchmarks stream out per combination
+struct trace_record_t
+{
+	int64_t rank;
+	double trace;
+};
+
+// eigen_sherman_openmp streaming a record per combination to /dev/null through
+// a result_writer_t, see writer.h, so the cost of the hand-off shows up as the
+// difference between the two
+bool eigen_sherman_writer()
+{
+	static result_writer_t writer("/dev/null", std::max(64, 2 * enumerate_threads(0)));
+	const auto& schedule = benchmark_schedule();
+	Eigen::MatrixXd main = Eigen::MatrixXd::Random(schedule.size(), schedule.size());
+
+	std::vector<std::unique_ptr<result_sink_t>> sinks;
+	for (int t = 0; t < enumerate_threads(0); ++t)
+	{
+		sinks.emplace_back(new result_sink_t(writer));
+	}
+	std::vector<char> finite(sinks.size(), true);
+	enumerate_openmp<sherman_engine_t>(main, schedule, 0, [&](int thread, const sherman_engine_t& engine)
+	{
+		auto trace = engine.inverse().trace();
+		finite[thread] = finite[thread] && std::isfinite(trace);
+		sinks[thread]->push(trace_record_t{ engine.rank(), trace });
+	});
+	return std::all_of(finite.begin(), finite.end(), [](char f) { return f; });
+}
+#endif
+
+// Same update scheme as eigen_sherman, but processes Lanes random main matrices in
+// lock-step, one per SIMD lane, all following the same schedule.
+template<int Lanes>
+bool eigen_sherman_lockstep()
+{
+	std::array<Eigen::MatrixXd, Lanes> mains;
+	for (auto& main : mains)
+	{
+		main = Eigen::MatrixXd::Random(11, 11);
+	}
+	lockstep_sherman_t<Lanes> lockstep(benchmark_schedule(), mains);
+	return lockstep.run();
+}
+
+// Branch-and-bound search for the best k of n items of a random SPD matrix,
+// reporting how much of the n choose k selections it had to visit.
+template<class Objective>
+int search_benchmark(int n, int k, const Objective& objective)
+{
+	Eigen::MatrixXd x = Eigen::MatrixXd::Random(n, 2 * n);
+	Eigen::MatrixXd a = x * x.transpose() / n;
+
+	auto start = std::chrono::steady_clock::now();
+	auto result = branch_and_bound(a, k, objective);
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	std::cout << "best " << result.value << " items";
+	for (auto item : result.items)
+	{
+		std::cout << " " << item;
+	}
+	std::cout << std::endl;
+	std::cout << "nodes " << result.nodes << " pruned " << result.pruned << " of " << binomial(n, k) << " selections" << std::endl;
+	std::cout << elapsed.count() << "s" << std::endl;
+	return 0;
+}
+
+// Running totals of the checkpointed enumeration
+struct trace_reduction_t
+{
+	double trace_sum;
+	int64_t finite;
+};
+
+// A long enumeration that saves checkpoints under path and resumes from them if
+// present. The main matrix is generated from a fixed seed so every run matches.
+int checkpoint_benchmark(const std::string& path, double interval_seconds)
+{
+	auto schedule = make_schedule({ {16, 8}, {10, 5} });
+	std::srand(1);
+	Eigen::MatrixXd main = Eigen::MatrixXd::Random(schedule->size(), schedule->size());
+	main.diagonal().array() += schedule->size();
+
+	checkpoint_options_t options;
+	options.path = path;
+	options.interval_seconds = interval_seconds;
+
+	auto start = std::chrono::steady_clock::now();
+	std::vector<trace_reduction_t> reductions;
+	try
+	{
+		reductions = enumerate_checkpointed<sherman_engine_t, trace_reduction_t>(main, *schedule, options,
+			[](trace_reduction_t& reduction, const sherman_engine_t& engine)
+		{
+			auto trace = engine.inverse().trace();
+			reduction.trace_sum += trace;
+			reduction.finite += std::isfinite(trace);
+		});
+	}
+	catch (const std::runtime_error& e)
+	{
+		std::cerr << e.what() << std::endl;
+		return 2;
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	remove_checkpoints(options, static_cast<int>(reductions.size()));
+
+	trace_reduction_t total = {};
+	for (const auto& reduction : reductions)
+	{
+		total.trace_sum += reduction.trace_sum;
+		total.finite += reduction.finite;
+	}
+	std::cout << "trace sum " << std::hexfloat << total.trace_sum << std::defaultfloat;
+	std::cout << " finite " << total.finite << " of " << schedule->combinations() << std::endl;
+	std::cout << elapsed.count() << "s" << std::endl;
+	return 0;
+}
+
+// Synthetic load on invert_service_t: jobs jobs of the benchmark shape, each
+// over its own main matrix, submitted at rate per second (as fast as possible if
+// zero) while earlier ones run. Reports the p50/p99 latency from submit to
+// result, against doing each job cold: a new schedule, engine and seed per job.
+int service_benchmark(int jobs, double rate)
+{
+	std::vector<group_t> groups = { {4, 3}, {7, 4} };
+	std::vector<Eigen::MatrixXd> mains;
+	for (int m = 0; m < 64; ++m)
+	{
+		mains.push_back(Eigen::MatrixXd::Random(11, 11));
+	}
+
+	auto cold_start = std::chrono::steady_clock::now();
+	auto cold_jobs = std::min(jobs, 1000);
+	for (int j = 0; j < cold_jobs; ++j)
+	{
+		auto schedule = make_schedule(groups);
+		sherman_engine_t engine(mains[j % mains.size()], *schedule);
+		auto best = std::numeric_limits<double>::infinity();
+		enumerate_range(engine, 0, schedule->combinations(), [&](const sherman_engine_t& e)
+		{
+			best = std::min(best, e.inverse().trace());
+		});
+	}
+	std::chrono::duration<double> cold = std::chrono::steady_clock::now() - cold_start;
+
+	// Requests arrive owning their matrices, so they are built before timing and
+	// moved in, leaving the copy into a worker's warm storage as the only one
+	std::vector<invert_job_t> requests;
+	requests.reserve(jobs);
+	for (int j = 0; j < jobs; ++j)
+	{
+		requests.push_back({ groups, mains[j % mains.size()] });
+	}
+
+	invert_service_t service;
+	std::vector<std::future<invert_job_result_t>> futures;
+	futures.reserve(jobs);
+	auto start = std::chrono::steady_clock::now();
+	for (int j = 0; j < jobs; ++j)
+	{
+		if (rate > 0)
+		{
+			std::this_thread::sleep_until(start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(j / rate)));
+		}
+		futures.push_back(service.submit(std::move(requests[j])));
+	}
+	std::vector<double> latencies;
+	auto finite = int64_t(0);
+	for (auto& future : futures)
+	{
+		auto result = future.get();
+		latencies.push_back(result.latency);
+		finite += result.finite;
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	std::sort(latencies.begin(), latencies.end());
+	auto percentile = [&](double p)
+	{
+		return latencies[std::min(latencies.size() - 1, static_cast<size_t>(p * latencies.size()))] * 1e6;
+	};
+	std::cout << jobs << " jobs on " << service.workers() << " workers, " << jobs / elapsed.count() << " jobs per second" << std::endl;
+	std::cout << "latency p50 " << percentile(0.5) << "us p99 " << percentile(0.99) << "us max " << latencies.back() * 1e6 << "us" << std::endl;
+	std::cout << "service: " << elapsed.count() * service.workers() / jobs * 1e6 << "us of worker time per job, including the submit thread's share" << std::endl;
+	std::cout << "cold, one job at a time: " << cold.count() / cold_jobs * 1e6 << "us per job" << std::endl;
+	return finite > 0 ? 0 : 1;
+}
+
+#ifdef __linux__
+// The checkpoint enumeration split across worker processes, which should give
+// the same finite count as a --checkpoint run and the same trace sum up to rounding.
+int shard_benchmark(int workers)
+{
+	auto schedule = make_schedule({ {16, 8}, {10, 5} });
+	std::srand(1);
+	Eigen::MatrixXd main = Eigen::MatrixXd::Random(schedule->size(), schedule->size());
+	main.diagonal().array() += schedule->size();
+
+	shard_options_t options;
+	options.workers = workers;
+	options.progress = &std::cerr;
+
+	auto start = std::chrono::steady_clock::now();
+	shard_result_t<trace_reduction_t> result;
+	try
+	{
+		result = enumerate_sharded<sherman_engine_t, trace_reduction_t>(main, *schedule, options,
+			[](trace_reduction_t& reduction, const sherman_engine_t& engine)
+		{
+			auto trace = engine.inverse().trace();
+			reduction.trace_sum += trace;
+			reduction.finite += std::isfinite(trace);
+		},
+			[](trace_reduction_t& total, const trace_reduction_t& shard)
+		{
+			total.trace_sum += shard.trace_sum;
+			total.finite += shard.finite;
+		});
+	}
+	catch (const std::runtime_error& e)
+	{
+		std::cerr << e.what() << std::endl;
+		return 2;
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	std::cout << "trace sum " << std::hexfloat << result.reduction.trace_sum << std::defaultfloat;
+	std::cout << " finite " << result.reduction.finite << " of " << schedule->combinations() << std::endl;
+	std::cout << result.workers << " workers, " << result.shards << " shards, " << result.reassigned << " reassigned" << std::endl;
+	std::cout << elapsed.count() << "s" << std::endl;
+	return result.combinations == schedule->combinations() ? 0 : 1;
+}
+
+// The sharded enumeration's shape on threads pinned across NUMA nodes, reporting
+// the throughput of each node so that scaling across sockets can be checked
+int numa_benchmark(int threads)
+{
+	auto topology = read_numa_topology();
+	auto schedule = make_schedule({ {16, 8}, {10, 5} });
+	std::srand(1);
+	Eigen::MatrixXd main = Eigen::MatrixXd::Random(schedule->size(), schedule->size());
+	main.diagonal().array() += schedule->size();
+
+	std::vector<int64_t> finite(enumerate_threads(threads), 0);
+	auto start = std::chrono::steady_clock::now();
+	auto nodes = enumerate_numa<sherman_engine_t>(main, *schedule, topology, threads, [&](int thread, const sherman_engine_t& engine)
+	{
+		finite[thread] += engine.inverse().allFinite();
+	});
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	for (size_t n = 0; n < nodes.size(); ++n)
+	{
+		std::cout << "node " << n << ": " << topology.nodes[n].size() << " cpus, " << nodes[n].threads << " threads, ";
+		std::cout << nodes[n].combinations << " combinations, " << nodes[n].throughput() << " per second" << std::endl;
+	}
+	auto total = std::accumulate(finite.begin(), finite.end(), int64_t(0));
+	std::cout << "finite " << total << " of " << schedule->combinations() << ", " << schedule->combinations() / elapsed.count() << " per second" << std::endl;
+	std::cout << elapsed.count() << "s" << std::endl;
+	return total == schedule->combinations() ? 0 : 1;
+}
+
+// The numa_benchmark enumeration writing a trace_record_t per combination to
+// path (a file, FIFO or /dev/null) on threads threads. Reports the writer's
+// backpressure: producer stalls mean the writer could not keep up.
+int write_benchmark(const std::string& path, int threads)
+{
+	auto schedule = make_schedule({ {16, 8}, {10, 5} });
+	std::srand(1);
+	Eigen::MatrixXd main = Eigen::MatrixXd::Random(schedule->size(), schedule->size());
+	main.diagonal().array() += schedule->size();
+
+	try
+	{
+		result_writer_t writer(path, std::max(64, 2 * enumerate_threads(threads)));
+		std::vector<std::unique_ptr<result_sink_t>> sinks;
+		for (int t = 0; t < enumerate_threads(threads); ++t)
+		{
+			sinks.emplace_back(new result_sink_t(writer));
+		}
+		auto start = std::chrono::steady_clock::now();
+		enumerate_openmp<sherman_engine_t>(main, *schedule, threads, [&](int thread, const sherman_engine_t& engine)
+		{
+			sinks[thread]->push(trace_record_t{ engine.rank(), engine.inverse().trace() });
+		});
+		std::chrono::duration<double> enumerated = std::chrono::steady_clock::now() - start;
+		sinks.clear();
+		writer.close();
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+		auto stats = writer.stats();
+		std::cout << schedule->combinations() << " records, " << stats.bytes << " bytes in " << stats.buffers << " buffers to " << path << std::endl;
+		std::cout << "producer stalls " << stats.producer_stalls << " (" << stats.producer_stall_seconds << "s), writer idle waits " << stats.writer_idle_waits << ", max queued " << stats.max_queued << std::endl;
+		std::cout << enumerated.count() << "s enumerating, " << elapsed.count() << "s until written" << std::endl;
+		if (stats.error != 0)
+		{
+			std::cerr << "write failed: " << std::strerror(stats.error) << std::endl;
+			return 2;
+		}
+		return stats.bytes == schedule->combinations() * sizeof(trace_record_t) ? 0 : 1;
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << e.what() << std::endl;
+		return 2;
+	}
+}
+
+// An enumeration over a main matrix of items items in a tiled file at path,
+// written tile by tile if it does not exist yet, picking one item from each
+// group of 16. Reports page faults and bytes read alongside the time, with the
+// file's pages dropped from the page cache first so the run starts cold.
+int tiled_benchmark(const std::string& path, int items, int distance)
+{
+	auto schedule = make_schedule(std::vector<group_t>(std::max(1, items / 16), { 16, 1 }), 100000);
+	auto size = schedule->size();
+	try
+	{
+		// Only a missing file is written; anything else at path must be a tiled
+		// matrix of the right size, so that no other file is ever overwritten
+		struct stat status;
+		if (stat(path.c_str(), &status) != 0)
+		{
+			if (errno != ENOENT)
+			{
+				throw std::runtime_error("cannot stat " + path + ": " + std::strerror(errno));
+			}
+			tiled_file_t::write(path, size, size, 32, [&](int64_t r, int64_t c)
+			{
+				return (r == c ? size : 0) + std::sin(r * 7.0 + c * 3.0);
+			});
+		}
+		std::unique_ptr<tiled_file_t> file(new tiled_file_t(path));
+		if (file->rows() != size || file->cols() != size)
+		{
+			throw std::runtime_error(path + " holds a " + std::to_string(file->rows()) + " x " + std::to_string(file->cols()) + " matrix, not " + std::to_string(size) + " x " + std::to_string(size) + "; remove it to have it rewritten");
+		}
+		auto fd = open(path.c_str(), O_RDONLY);
+		if (fd >= 0)
+		{
+			posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+			close(fd);
+		}
+
+		tiled_sherman_engine_t engine(*file, *schedule, distance);
+		auto finite = int64_t(0);
+		auto before = io_stats();
+		auto start = std::chrono::steady_clock::now();
+		enumerate_range(engine, 0, schedule->combinations(), [&](const tiled_sherman_engine_t& e)
+		{
+			finite += e.inverse().allFinite();
+		});
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		auto io = io_stats() - before;
+
+		std::cout << "finite " << finite << " of " << schedule->combinations() << ", main " << size << " items, prefetch distance " << distance << std::endl;
+		std::cout << "faults minor " << io.minor_faults << " major " << io.major_faults << ", read " << io.read_bytes << " bytes" << std::endl;
+		std::cout << elapsed.count() << "s" << std::endl;
+		return finite == schedule->combinations() ? 0 : 1;
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << e.what() << std::endl;
+		return 2;
+	}
+}
+#endif
+
+int main(int argc, char* argv[])
 {
 	// Benchmark a series of approaches to the problem
 	auto iterations = 10000;
 
+	// --perf adds hardware counters per combination, summed over the main thread and
+	// the OpenMP workers; threads of their own, e.g. stream producers and writers,
+	// are not counted.
+	// --sweep instead times every engine over a grid of shapes, see sweep.h.
+	// --save writes the timing samples to a results file, and --baseline compares
+	// them against a saved one, failing if any benchmark is more than --threshold
+	// percent slower. --samples sets how many timings each benchmark is split into.
+	// --alloc reports heap allocations per combination, and --strict-alloc also
+	// aborts if an engine's steady-state loop allocates.
+	// --search N K logdet|trace runs the branch-and-bound search instead.
+	// --checkpoint PATH runs a long enumeration that can be interrupted and resumed,
+	// saving every --interval seconds (default 10).
+	// --shards WORKERS runs the same enumeration across worker processes (Linux only).
+	// --tiled PATH ITEMS DISTANCE enumerates over an out-of-core main matrix in a
+	// tiled file, prefetching DISTANCE swaps ahead (Linux only).
+	// --service JOBS RATE puts synthetic load on the asynchronous service and
+	// reports job latency percentiles and worker time per job against building
+	// everything cold per job; RATE is jobs per second, zero for no pacing.
+	// --numa THREADS runs it on threads pinned across NUMA nodes, with per-node
+	// throughput; zero threads means the OpenMP default (Linux only).
+	// --write PATH THREADS runs it streaming a record per combination to PATH
+	// through the writer thread of writer.h, reporting backpressure (Linux only).
+	auto perf = false;
+	auto alloc = false;
+	auto samples = 5;
+	auto threshold = 5.0;
+	std::string save_path;
+	std::string checkpoint_path;
+	auto interval = 10.0;
+	std::string baseline_path;
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		auto has_value = i + 1 < argc;
+		if (arg == "--perf")
+		{
+			perf = true;
+		}
+		else if (arg == "--alloc")
+		{
+			alloc = true;
+		}
+		else if (arg == "--strict-alloc")
+		{
+			alloc = true;
+			alloc_strict = true;
+		}
+		else if (arg == "--search" && i + 3 < argc)
+		{
+			auto n = std::stoi(argv[i + 1]);
+			auto k = std::stoi(argv[i + 2]);
+			if (std::string(argv[i + 3]) == "trace")
+			{
+				return search_benchmark(n, k, trace_inverse_objective_t());
+			}
+			return search_benchmark(n, k, logdet_objective_t());
+		}
+		else if (arg == "--sweep")
+		{
+			return run_sweep(parse_sweep_options(argc, argv), std::cout);
+		}
+		else if (arg == "--iterations" && has_value)
+		{
+			iterations = std::stoi(argv[++i]);
+		}
+		else if (arg == "--samples" && has_value)
+		{
+			samples = std::max(1, std::stoi(argv[++i]));
+		}
+		else if (arg == "--threshold" && has_value)
+		{
+			threshold = std::stod(argv[++i]);
+		}
+		else if (arg == "--checkpoint" && has_value)
+		{
+			checkpoint_path = argv[++i];
+		}
+		else if (arg == "--service" && i + 2 < argc)
+		{
+			return service_benchmark(std::stoi(argv[i + 1]), std::stod(argv[i + 2]));
+		}
+#ifdef __linux__
+		else if (arg == "--shards" && has_value)
+		{
+			return shard_benchmark(std::stoi(argv[++i]));
+		}
+		else if (arg == "--numa" && has_value)
+		{
+			return numa_benchmark(std::stoi(argv[++i]));
+		}
+		else if (arg == "--write" && i + 2 < argc)
+		{
+			return write_benchmark(argv[i + 1], std::stoi(argv[i + 2]));
+		}
+		else if (arg == "--tiled" && i + 3 < argc)
+		{
+			return tiled_benchmark(argv[i + 1], std::stoi(argv[i + 2]), std::stoi(argv[i + 3]));
+		}
+#endif
+		else if (arg == "--interval" && has_value)
+		{
+			interval = std::stod(argv[++i]);
+		}
+		else if (arg == "--save" && has_value)
+		{
+			save_path = argv[++i];
+		}
+		else if (arg == "--baseline" && has_value)
+		{
+			baseline_path = argv[++i];
+		}
+	}
+
+	if (!checkpoint_path.empty())
+	{
+		return checkpoint_benchmark(checkpoint_path, interval);
+	}
+
+	benchmark_results_t baseline;
+	if (!baseline_path.empty())
+	{
+		if (samples < static_cast<int>(min_compare_samples))
+		{
+			std::cerr << "--baseline needs --samples " << min_compare_samples << " or more to test for regressions" << std::endl;
+			return 2;
+		}
+		try
+		{
+			baseline = load_results(baseline_path);
+		}
+		catch (const std::runtime_error& e)
+		{
+			std::cerr << e.what() << std::endl;
+			return 2;
+		}
+	}
+
+	std::unique_ptr<perf_counters_t> counters;
+	if (perf)
+	{
+		counters.reset(new perf_counters_t(benchmark_thread_ids()));
+		if (!counters->available())
+		{
+			std::cout << "perf events are not permitted, reporting time only" << std::endl;
+			counters.reset();
+		}
+	}
+
 	benchmark_t benchmarks[] = {
 		{"eigen_random", eigen_random},
 		{"eigen_random_openmp", eigen_random_openmp},
 		{"eigen_sherman", eigen_sherman},
+		{"eigen_sherman_schedule", eigen_sherman_schedule},
+		{"eigen_sherman_stream", eigen_sherman_stream},
+		{"eigen_sherman_fixed", eigen_sherman_fixed},
+		{"eigen_sherman_api", eigen_sherman_api},
+		{"eigen_sherman_condition", eigen_sherman_condition},
+		{"eigen_sherman_cross", eigen_sherman_cross, 8},
+		{"eigen_sherman_delayed", eigen_sherman_delayed},
+		{"ridge_inverse", ridge_inverse, 32},
+		{"ridge_eigen", ridge_eigen, 32},
+		{"eigen_sherman_openmp", eigen_sherman_openmp},
+		{"eigen_block_openmp", eigen_block_openmp},
+#ifdef __linux__
+		{"eigen_sherman_numa", eigen_sherman_numa},
+		{"eigen_sherman_writer", eigen_sherman_writer},
+#endif
+		{"eigen_sherman_lockstep4", eigen_sherman_lockstep<4>, 4},
+		{"eigen_sherman_lockstep8", eigen_sherman_lockstep<8>, 8},
+		{"eigen_sherman_lockstep16", eigen_sherman_lockstep<16>, 16},
 	};
 
+	auto results = current_results();
 	for (const auto& benchmark : benchmarks)
 	{
+		auto calls = iterations / benchmark.batch;
+		if (counters)
+		{
+			counters->start();
+		}
+
+		auto allocs_before = alloc_counts();
+		reset_phase_totals();
+
+		// Split the calls into samples, recording ns per combination for each
+		benchmark_result_t result = { benchmark.name, {} };
+		auto seconds = 0.0;
+		for (int sample = 0; sample < samples; ++sample)
+		{
+			auto sample_calls = calls * (sample + 1) / samples - calls * sample / samples;
+			auto sample_seconds = time_func(benchmark.func, sample_calls).count();
+			auto combinations = static_cast<double>(sample_calls) * benchmark.batch * benchmark_schedule().combinations();
+			seconds += sample_seconds;
+			result.samples.push_back(sample_seconds * 1e9 / combinations);
+		}
+		results.benchmarks.push_back(result);
+		auto allocs_after = alloc_counts();
+
+		if (counters)
+		{
+			counters->stop();
+		}
 		std::cout << std::left << std::setw(30) << benchmark.name;
-		std::cout << time_func(benchmark.func, iterations).count() << "s" << std::endl;
+		std::cout << seconds << "s" << std::endl;
+
+		// Only when built with INVERT_PHASE_TIMERS, and only for instrumented engines
+		auto phases = merge_phase_totals();
+		uint64_t phase_ticks_total = 0;
+		for (auto ticks : phases.ticks)
+		{
+			phase_ticks_total += ticks;
+		}
+		if (phase_timers_enabled && phase_ticks_total > 0)
+		{
+			auto combinations = static_cast<double>(calls) * benchmark.batch * benchmark_schedule().combinations();
+			std::cout << "  phases, ticks per combination:";
+			for (int phase = 0; phase < phase_count; ++phase)
+			{
+				std::cout << " " << phase_name(phase) << " " << phases.ticks[phase] / combinations
+					<< " (" << std::lround(100.0 * phases.ticks[phase] / phase_ticks_total) << "%)";
+			}
+			std::cout << std::endl;
+		}
+
+		if (alloc)
+		{
+			auto combinations = static_cast<double>(calls) * benchmark.batch * benchmark_schedule().combinations();
+			std::cout << "  per combination: allocations " << (allocs_after.allocations - allocs_before.allocations) / combinations;
+			std::cout << " bytes " << (allocs_after.bytes - allocs_before.bytes) / combinations << std::endl;
+		}
+
+		if (counters)
+		{
+			auto counts = counters->read();
+			auto combinations = static_cast<double>(calls) * benchmark.batch * benchmark_schedule().combinations();
+			std::cout << "  per combination:";
+			for (int event = 0; event < perf_event_count; ++event)
+			{
+				std::cout << " " << perf_event_name(event) << " ";
+				if (counts.valid[event])
+				{
+					std::cout << counts.counts[event] / combinations;
+				}
+				else
+				{
+					std::cout << "n/a";
+				}
+			}
+			std::cout << std::endl;
+		}
+	}
+
+	if (!save_path.empty())
+	{
+		try
+		{
+			save_results(save_path, results);
+		}
+		catch (const std::runtime_error& e)
+		{
+			std::cerr << e.what() << std::endl;
+			return 2;
+		}
+	}
+	if (!baseline_path.empty())
+	{
+		std::cout << std::endl << "Compared with " << baseline_path << ":" << std::endl;
+		if (compare_results(baseline, results, threshold / 100, std::cout) > 0)
+		{
+			return 1;
+		}
 	}
 
 	// Processor: Intel(R) Core(TM) i7-3770K CPU @ 3.50GHz, 3901 Mhz, 4 Core(s), 8 Logical Processor(s)
@@ -0,0 +1,130 @@
+#include <algorithm>
+#include <stdexcept>
+#include "eigen/Dense"
+
+#include "invert_api.h"
+#include "direct.h"
+#include "enumerate.h"
+#include "schedule.h"
+#include "sherman.h"
+
+int invert_api_version()
+{
+	return INVERT_API_VERSION;
+}
+
+struct invert_enumerator_t::impl_t
+{
+	std::shared_ptr<const schedule_t> schedule;
+	invert_engine_kind_t engine;
+};
+
+// The public view of an engine's current combination
+template<class Engine>
+static invert_combination_t combination_view(const Engine& engine)
+{
+	return { engine.rank(), engine.comb_size(), engine.comb_to_main().data(), engine.inverse().data() };
+}
+
+template<class Engine>
+static void enumerate_engine(const schedule_t& schedule, const double* main, int64_t begin, int64_t end, const std::function<void(const invert_combination_t&)>& visit)
+{
+	Eigen::Map<const Eigen::MatrixXd> m(main, schedule.size(), schedule.size());
+	Engine engine(m, schedule);
+	enumerate_range(engine, begin, end, [&](const Engine& e)
+	{
+		visit(combination_view(e));
+	});
+}
+
+template<class Engine>
+static void enumerate_engine_parallel(const schedule_t& schedule, const double* main, int threads, const std::function<void(int, const invert_combination_t&)>& visit)
+{
+	Eigen::Map<const Eigen::MatrixXd> m(main, schedule.size(), schedule.size());
+	enumerate_openmp<Engine>(m, schedule, threads, [&](int thread, const Engine& e)
+	{
+		visit(thread, combination_view(e));
+	});
+}
+
+invert_enumerator_t::invert_enumerator_t(const std::vector<invert_group_t>& groups, invert_engine_kind_t engine)
+{
+	if (groups.empty())
+	{
+		throw std::invalid_argument("invert: no groups");
+	}
+	std::vector<group_t> layout;
+	for (const auto& group : groups)
+	{
+		if (!valid_group({ group.size, group.pick }))
+		{
+			throw std::invalid_argument("invert: invalid group");
+		}
+		layout.push_back({ group.size, group.pick });
+	}
+	impl_.reset(new impl_t{ make_schedule(layout), engine });
+}
+
+invert_enumerator_t::~invert_enumerator_t() = default;
+invert_enumerator_t::invert_enumerator_t(invert_enumerator_t&& other) noexcept = default;
+invert_enumerator_t& invert_enumerator_t::operator=(invert_enumerator_t&& other) noexcept = default;
+
+int invert_enumerator_t::size() const
+{
+	return impl_->schedule->size();
+}
+
+int invert_enumerator_t::comb_size() const
+{
+	return impl_->schedule->comb_size();
+}
+
+int64_t invert_enumerator_t::combinations() const
+{
+	return impl_->schedule->combinations();
+}
+
+std::vector<int> invert_enumerator_t::selection(int64_t rank) const
+{
+	if (rank < 0 || rank >= combinations())
+	{
+		throw std::out_of_range("invert: rank out of range");
+	}
+	return impl_->schedule->selection_at(rank);
+}
+
+invert_swap_t invert_enumerator_t::swap(int64_t rank) const
+{
+	if (rank < 0 || rank + 1 >= combinations())
+	{
+		throw std::out_of_range("invert: no swap at rank");
+	}
+	const auto& swap = (*impl_->schedule)[rank];
+	return { swap.removed, swap.added, swap.slot };
+}
+
+void invert_enumerator_t::enumerate(const double* main, int64_t begin, int64_t end, const std::function<void(const invert_combination_t&)>& visit) const
+{
+	begin = std::max<int64_t>(begin, 0);
+	end = std::min(end, combinations());
+	if (impl_->engine == invert_engine_direct)
+	{
+		enumerate_engine<direct_engine_t>(*impl_->schedule, main, begin, end, visit);
+	}
+	else
+	{
+		enumerate_engine<sherman_engine_t>(*impl_->schedule, main, begin, end, visit);
+	}
+}
+
+void invert_enumerator_t::enumerate_parallel(const double* main, int threads, const std::function<void(int, const invert_combination_t&)>& visit) const
+{
+	if (impl_->engine == invert_engine_direct)
+	{
+		enumerate_engine_parallel<direct_engine_t>(*impl_->schedule, main, threads, visit);
+	}
+	else
+	{
+		enumerate_engine_parallel<sherman_engine_t>(*impl_->schedule, main, threads, visit);
+	}
+}
@@ -0,0 +1,99 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+// The stable C++ interface of the invert library. Nothing here depends on Eigen
+// or on the layout of the engines, which live behind invert_enumerator_t, so
+// code built against this header keeps working as the internals change.
+// Matrices are passed as column-major arrays of doubles.
+
+// Bumped whenever this header changes incompatibly
+#define INVERT_API_VERSION 1
+
+// Version of the library that was linked, to compare with INVERT_API_VERSION
+int invert_api_version();
+
+// A group of size items from which pick are selected. Groups are listed outermost
+// first; the last group changes fastest and owns the lowest item indices.
+struct invert_group_t
+{
+	int size;
+	int pick;
+};
+
+// One step of the enumeration: item removed is replaced by item added, which
+// takes over its row/column slot of the combination
+struct invert_swap_t
+{
+	int removed;
+	int added;
+	int slot;
+};
+
+// How the inverse of each combination is obtained
+enum invert_engine_kind_t
+{
+	// Two Sherman-Morrison rank-1 updates per swap
+	invert_engine_sherman,
+
+	// A direct inversion of every combination
+	invert_engine_direct
+};
+
+// The current combination, valid only during the visit it is passed to
+struct invert_combination_t
+{
+	int64_t rank;
+	int size;
+
+	// Index into the main matrix of each row/column of the combination
+	const int* items;
+
+	// Inverse of the combination matrix, size x size, column-major
+	const double* inverse;
+};
+
+// Enumerates every combination of a group layout and the inverse of the
+// corresponding principal submatrix of a main matrix. The swap sequence is built
+// once on construction and reused by every enumeration, from any number of threads.
+class invert_enumerator_t
+{
+	struct impl_t;
+	std::unique_ptr<const impl_t> impl_;
+
+public:
+	// Throws std::invalid_argument for an empty layout or a group with pick
+	// outside [1, size] or more than 31 items
+	explicit invert_enumerator_t(const std::vector<invert_group_t>& groups, invert_engine_kind_t engine = invert_engine_sherman);
+	~invert_enumerator_t();
+	invert_enumerator_t(invert_enumerator_t&& other) noexcept;
+	invert_enumerator_t& operator=(invert_enumerator_t&& other) noexcept;
+
+	// Number of items in the main matrix
+	int size() const;
+
+	// Number of items in each combination
+	int comb_size() const;
+
+	// Number of combinations
+	int64_t combinations() const;
+
+	// Items of combination rank, in slot order. Throws std::out_of_range unless
+	// rank is in [0, combinations()).
+	std::vector<int> selection(int64_t rank) const;
+
+	// The swap from combination rank to rank + 1. Throws std::out_of_range unless
+	// rank is in [0, combinations() - 1).
+	invert_swap_t swap(int64_t rank) const;
+
+	// Visit combinations [begin, end) of main, a size() x size() matrix, on the
+	// calling thread. visit must not allocate when strict allocation checks are on.
+	void enumerate(const double* main, int64_t begin, int64_t end, const std::function<void(const invert_combination_t&)>& visit) const;
+
+	// Visit every combination of main, split into one contiguous range per thread,
+	// or per OpenMP thread if threads is zero or less. visit(thread, combination)
+	// is called concurrently from different threads.
+	void enumerate_parallel(const double* main, int threads, const std::function<void(int, const invert_combination_t&)>& visit) const;
+};
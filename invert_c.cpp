@@ -0,0 +1,173 @@
+#include <algorithm>
+#include <new>
+#include <stdexcept>
+#include <vector>
+
+#include "invert_api.h"
+#include "invert_c.h"
+
+struct invert_c_enumerator_t
+{
+	invert_enumerator_t enumerator;
+};
+
+// Run f, turning exceptions into error codes
+template<class F>
+static int invert_c_call(F&& f)
+{
+	try
+	{
+		f();
+		return INVERT_C_OK;
+	}
+	catch (const std::invalid_argument&)
+	{
+		return INVERT_C_INVALID_ARGUMENT;
+	}
+	catch (const std::out_of_range&)
+	{
+		return INVERT_C_OUT_OF_RANGE;
+	}
+	catch (const std::bad_alloc&)
+	{
+		return INVERT_C_OUT_OF_MEMORY;
+	}
+	catch (...)
+	{
+		return INVERT_C_FAILED;
+	}
+}
+
+// The range [begin, end) clamped to the enumeration, or an error if it is not a range
+static void invert_c_check(const invert_c_enumerator_t* enumerator, const double* main, int64_t& begin, int64_t& end)
+{
+	if (!enumerator || !main || begin < 0 || end < begin)
+	{
+		throw std::invalid_argument("invert_c: invalid argument");
+	}
+	end = std::min(end, enumerator->enumerator.combinations());
+	begin = std::min(begin, end);
+}
+
+int invert_c_version(void)
+{
+	return invert_api_version();
+}
+
+int invert_c_create(const invert_c_group_t* groups, int group_count, int engine, invert_c_enumerator_t** enumerator)
+{
+	if (!groups || group_count <= 0 || !enumerator || (engine != INVERT_C_ENGINE_SHERMAN && engine != INVERT_C_ENGINE_DIRECT))
+	{
+		return INVERT_C_INVALID_ARGUMENT;
+	}
+	return invert_c_call([&]()
+	{
+		std::vector<invert_group_t> layout;
+		for (int g = 0; g < group_count; ++g)
+		{
+			layout.push_back({ groups[g].size, groups[g].pick });
+		}
+		auto kind = engine == INVERT_C_ENGINE_DIRECT ? invert_engine_direct : invert_engine_sherman;
+		*enumerator = new invert_c_enumerator_t{ invert_enumerator_t(layout, kind) };
+	});
+}
+
+void invert_c_destroy(invert_c_enumerator_t* enumerator)
+{
+	delete enumerator;
+}
+
+int invert_c_size(const invert_c_enumerator_t* enumerator)
+{
+	return enumerator ? enumerator->enumerator.size() : 0;
+}
+
+int invert_c_comb_size(const invert_c_enumerator_t* enumerator)
+{
+	return enumerator ? enumerator->enumerator.comb_size() : 0;
+}
+
+int64_t invert_c_combinations(const invert_c_enumerator_t* enumerator)
+{
+	return enumerator ? enumerator->enumerator.combinations() : 0;
+}
+
+int invert_c_selection(const invert_c_enumerator_t* enumerator, int64_t rank, int* items)
+{
+	if (!enumerator || !items)
+	{
+		return INVERT_C_INVALID_ARGUMENT;
+	}
+	return invert_c_call([&]()
+	{
+		auto selection = enumerator->enumerator.selection(rank);
+		std::copy(selection.begin(), selection.end(), items);
+	});
+}
+
+int invert_c_swap(const invert_c_enumerator_t* enumerator, int64_t rank, invert_c_swap_t* swap)
+{
+	if (!enumerator || !swap)
+	{
+		return INVERT_C_INVALID_ARGUMENT;
+	}
+	return invert_c_call([&]()
+	{
+		auto next = enumerator->enumerator.swap(rank);
+		*swap = { next.removed, next.added, next.slot };
+	});
+}
+
+int invert_c_enumerate(const invert_c_enumerator_t* enumerator, const double* main, int64_t begin, int64_t end, invert_c_visit_t visit, void* user)
+{
+	return invert_c_call([&]()
+	{
+		invert_c_check(enumerator, main, begin, end);
+		if (!visit)
+		{
+			throw std::invalid_argument("invert_c: no visit");
+		}
+		enumerator->enumerator.enumerate(main, begin, end, [&](const invert_combination_t& combination)
+		{
+			visit(user, combination.rank, combination.items, combination.inverse);
+		});
+	});
+}
+
+int invert_c_traces(const invert_c_enumerator_t* enumerator, const double* main, int64_t begin, int64_t end, double* traces)
+{
+	return invert_c_call([&]()
+	{
+		invert_c_check(enumerator, main, begin, end);
+		if (!traces)
+		{
+			throw std::invalid_argument("invert_c: no output");
+		}
+		enumerator->enumerator.enumerate(main, begin, end, [&](const invert_combination_t& combination)
+		{
+			auto trace = 0.0;
+			for (int i = 0; i < combination.size; ++i)
+			{
+				trace += combination.inverse[i * combination.size + i];
+			}
+			traces[combination.rank - begin] = trace;
+		});
+	});
+}
+
+int invert_c_inverses(const invert_c_enumerator_t* enumerator, const double* main, int64_t begin, int64_t end, double* inverses)
+{
+	return invert_c_call([&]()
+	{
+		invert_c_check(enumerator, main, begin, end);
+		if (!inverses)
+		{
+			throw std::invalid_argument("invert_c: no output");
+		}
+		enumerator->enumerator.enumerate(main, begin, end, [&](const invert_combination_t& combination)
+		{
+			auto count = combination.size * combination.size;
+			std::copy(combination.inverse, combination.inverse + count, inverses + (combination.rank - begin) * count);
+		});
+	});
+}
@@ -0,0 +1,75 @@
+#ifndef INVERT_C_H
+#define INVERT_C_H
+#include <stdint.h>
+
+/* A thin C interface over invert_api.h for batch use from other languages.
+   Functions return INVERT_C_OK or an error code and never throw. Matrices are
+   column-major arrays of doubles. */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum
+{
+	INVERT_C_OK = 0,
+	INVERT_C_INVALID_ARGUMENT = 1,
+	INVERT_C_OUT_OF_MEMORY = 2,
+	INVERT_C_FAILED = 3,
+	INVERT_C_OUT_OF_RANGE = 4
+};
+
+enum
+{
+	INVERT_C_ENGINE_SHERMAN = 0,
+	INVERT_C_ENGINE_DIRECT = 1
+};
+
+typedef struct invert_c_group_t
+{
+	int size;
+	int pick;
+} invert_c_group_t;
+
+typedef struct invert_c_swap_t
+{
+	int removed;
+	int added;
+	int slot;
+} invert_c_swap_t;
+
+typedef struct invert_c_enumerator_t invert_c_enumerator_t;
+
+/* Called at every combination with its rank, its comb_size items and its
+   comb_size x comb_size inverse, which are only valid during the call */
+typedef void (*invert_c_visit_t)(void* user, int64_t rank, const int* items, const double* inverse);
+
+int invert_c_version(void);
+
+/* Build the enumeration of a group layout, see invert_group_t */
+int invert_c_create(const invert_c_group_t* groups, int group_count, int engine, invert_c_enumerator_t** enumerator);
+void invert_c_destroy(invert_c_enumerator_t* enumerator);
+
+int invert_c_size(const invert_c_enumerator_t* enumerator);
+int invert_c_comb_size(const invert_c_enumerator_t* enumerator);
+int64_t invert_c_combinations(const invert_c_enumerator_t* enumerator);
+
+/* The comb_size items of combination rank into items, and the swap from rank
+   to rank + 1 into swap, see invert_enumerator_t. INVERT_C_OUT_OF_RANGE if
+   there is no such combination or swap. */
+int invert_c_selection(const invert_c_enumerator_t* enumerator, int64_t rank, int* items);
+int invert_c_swap(const invert_c_enumerator_t* enumerator, int64_t rank, invert_c_swap_t* swap);
+
+/* Visit combinations [begin, end) of main, a size x size matrix */
+int invert_c_enumerate(const invert_c_enumerator_t* enumerator, const double* main, int64_t begin, int64_t end, invert_c_visit_t visit, void* user);
+
+/* Batch calls over combinations [begin, end) of main. traces receives end - begin
+   values; inverses receives end - begin matrices of comb_size x comb_size. */
+int invert_c_traces(const invert_c_enumerator_t* enumerator, const double* main, int64_t begin, int64_t end, double* traces);
+int invert_c_inverses(const invert_c_enumerator_t* enumerator, const double* main, int64_t begin, int64_t end, double* inverses);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,282 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <vector>
+#include <cmath>
+#include "eigen/Dense"
+
+#include "alloc.h"
+#include "schedule.h"
+
+// Runs the Sherman-Morrison update over Lanes main matrices at once. The swap
+// schedule only depends on the group shape, so every lane applies the same
+// row/column replacement to its own matrix at each step.
+//
+// Storage is interleaved so that element (i, j) of every lane is contiguous,
+// which turns each rank-1 update into full-width vector arithmetic over lanes.
+template<int Lanes>
+class lockstep_sherman_t
+{
+	const schedule_t& schedule_;
+	int size_;
+	int comb_size_;
+
+	// main_[(i * size + j) * Lanes + lane] = main matrix of lane at (i, j)
+	std::vector<double> main_;
+
+	// inverse_[(i * comb_size + j) * Lanes + lane] = inverse of lane at (i, j)
+	std::vector<double> inverse_;
+
+	// Scratch vectors, one value per lane for each row/column index
+	std::vector<double> v_;
+	std::vector<double> w_;
+	std::vector<double> inv_col_;
+	std::vector<double> inv_row_;
+	std::array<double, Lanes> denom_;
+	std::array<bool, Lanes> finite_;
+
+	std::vector<int> comb_to_main_;
+
+	double& main_at(int i, int j, int lane) { return main_[(i * size_ + j) * Lanes + lane]; }
+	double* main_at(int i, int j) { return &main_[(i * size_ + j) * Lanes]; }
+	double* inverse_at(int i, int j) { return &inverse_[(i * comb_size_ + j) * Lanes]; }
+
+public:
+	// Interleave the main matrices, which must all be schedule.size() square
+	lockstep_sherman_t(const schedule_t& schedule, const std::array<Eigen::MatrixXd, Lanes>& mains)
+		:
+	schedule_(schedule),
+	size_(schedule.size()),
+	comb_size_(schedule.comb_size()),
+	main_(size_ * size_ * Lanes),
+	inverse_(comb_size_ * comb_size_ * Lanes),
+	v_(comb_size_ * Lanes),
+	w_(comb_size_ * Lanes),
+	inv_col_(comb_size_ * Lanes),
+	inv_row_(comb_size_ * Lanes)
+	{
+		for (int i = 0; i < size_; ++i)
+		{
+			for (int j = 0; j < size_; ++j)
+			{
+				for (int lane = 0; lane < Lanes; ++lane)
+				{
+					main_at(i, j, lane) = mains[lane](i, j);
+				}
+			}
+		}
+		finite_.fill(true);
+	}
+
+	// Enumerate every combination, returning true if all inverses of all lanes were finite
+	bool run()
+	{
+		seed();
+		{
+			no_alloc_scope_t scope;
+			for (const auto& swap : schedule_.swaps())
+			{
+				comb_to_main_[swap.slot] = swap.added;
+				update(swap.removed, swap.added, swap.slot);
+			}
+		}
+
+		auto success = true;
+		for (int lane = 0; lane < Lanes; ++lane)
+		{
+			success = success && finite_[lane];
+		}
+		return success;
+	}
+
+	// Inverse of the current combination for one lane
+	Eigen::MatrixXd inverse(int lane) const
+	{
+		Eigen::MatrixXd inverse(comb_size_, comb_size_);
+		for (int i = 0; i < comb_size_; ++i)
+		{
+			for (int j = 0; j < comb_size_; ++j)
+			{
+				inverse(i, j) = inverse_[(i * comb_size_ + j) * Lanes + lane];
+			}
+		}
+		return inverse;
+	}
+
+	// Index into the main matrix of each row/column of the current combination
+	const std::vector<int>& comb_to_main() const
+	{
+		return comb_to_main_;
+	}
+
+private:
+	// Directly invert the initial combination of each lane
+	void seed()
+	{
+		comb_to_main_ = schedule_.initial();
+
+		Eigen::MatrixXd combination(comb_size_, comb_size_);
+		for (int lane = 0; lane < Lanes; ++lane)
+		{
+			for (int i = 0; i < comb_size_; ++i)
+			{
+				for (int j = 0; j < comb_size_; ++j)
+				{
+					combination(i, j) = main_at(comb_to_main_[i], comb_to_main_[j], lane);
+				}
+			}
+			Eigen::MatrixXd inverse = combination.inverse();
+			for (int i = 0; i < comb_size_; ++i)
+			{
+				for (int j = 0; j < comb_size_; ++j)
+				{
+					inverse_at(i, j)[lane] = inverse(i, j);
+				}
+			}
+		}
+	}
+
+	// Replace row and then column slot of every lane's combination, updating the inverses
+	void update(int removed, int added, int slot)
+	{
+		// Row replacement: u = e_slot, v = new row - old row. The old row was taken
+		// before the mapping changed, so its slot column is the removed item.
+		for (int j = 0; j < comb_size_; ++j)
+		{
+			auto new_row = main_at(added, comb_to_main_[j]);
+			auto old_row = main_at(removed, j == slot ? removed : comb_to_main_[j]);
+			auto v = &v_[j * Lanes];
+			#pragma omp simd
+			for (int lane = 0; lane < Lanes; ++lane)
+			{
+				v[lane] = new_row[lane] - old_row[lane];
+			}
+		}
+
+		// w = v * inv
+		std::fill(w_.begin(), w_.end(), 0.0);
+		for (int i = 0; i < comb_size_; ++i)
+		{
+			auto v = &v_[i * Lanes];
+			for (int j = 0; j < comb_size_; ++j)
+			{
+				auto inv = inverse_at(i, j);
+				auto w = &w_[j * Lanes];
+				#pragma omp simd
+				for (int lane = 0; lane < Lanes; ++lane)
+				{
+					w[lane] += v[lane] * inv[lane];
+				}
+			}
+		}
+
+		// inv -= inv.col(slot) * w / (1 + w[slot])
+		for (int i = 0; i < comb_size_; ++i)
+		{
+			auto inv = inverse_at(i, slot);
+			auto col = &inv_col_[i * Lanes];
+			#pragma omp simd
+			for (int lane = 0; lane < Lanes; ++lane)
+			{
+				col[lane] = inv[lane];
+			}
+		}
+		{
+			auto w = &w_[slot * Lanes];
+			#pragma omp simd
+			for (int lane = 0; lane < Lanes; ++lane)
+			{
+				denom_[lane] = 1 / (1 + w[lane]);
+			}
+		}
+		for (int i = 0; i < comb_size_; ++i)
+		{
+			auto col = &inv_col_[i * Lanes];
+			for (int j = 0; j < comb_size_; ++j)
+			{
+				auto inv = inverse_at(i, j);
+				auto w = &w_[j * Lanes];
+				#pragma omp simd
+				for (int lane = 0; lane < Lanes; ++lane)
+				{
+					inv[lane] -= col[lane] * w[lane] * denom_[lane];
+				}
+			}
+		}
+
+		// Column replacement: u = new column - old column, v = e_slot. The old column
+		// already holds the replaced row, so its slot entry is unchanged.
+		for (int i = 0; i < comb_size_; ++i)
+		{
+			auto new_col = main_at(comb_to_main_[i], added);
+			auto old_col = i == slot ? new_col : main_at(comb_to_main_[i], removed);
+			auto u = &v_[i * Lanes];
+			#pragma omp simd
+			for (int lane = 0; lane < Lanes; ++lane)
+			{
+				u[lane] = new_col[lane] - old_col[lane];
+			}
+		}
+
+		// z = inv * u
+		std::fill(w_.begin(), w_.end(), 0.0);
+		for (int i = 0; i < comb_size_; ++i)
+		{
+			auto z = &w_[i * Lanes];
+			for (int j = 0; j < comb_size_; ++j)
+			{
+				auto inv = inverse_at(i, j);
+				auto u = &v_[j * Lanes];
+				#pragma omp simd
+				for (int lane = 0; lane < Lanes; ++lane)
+				{
+					z[lane] += inv[lane] * u[lane];
+				}
+			}
+		}
+
+		// inv -= z * inv.row(slot) / (1 + z[slot])
+		for (int j = 0; j < comb_size_; ++j)
+		{
+			auto inv = inverse_at(slot, j);
+			auto row = &inv_row_[j * Lanes];
+			#pragma omp simd
+			for (int lane = 0; lane < Lanes; ++lane)
+			{
+				row[lane] = inv[lane];
+			}
+		}
+		{
+			auto z = &w_[slot * Lanes];
+			#pragma omp simd
+			for (int lane = 0; lane < Lanes; ++lane)
+			{
+				denom_[lane] = 1 / (1 + z[lane]);
+			}
+		}
+		for (int i = 0; i < comb_size_; ++i)
+		{
+			auto z = &w_[i * Lanes];
+			for (int j = 0; j < comb_size_; ++j)
+			{
+				auto inv = inverse_at(i, j);
+				auto row = &inv_row_[j * Lanes];
+				#pragma omp simd
+				for (int lane = 0; lane < Lanes; ++lane)
+				{
+					inv[lane] -= z[lane] * row[lane] * denom_[lane];
+				}
+			}
+		}
+
+		// Finiteness is tracked per lane without branching in the update itself
+		for (int i = 0; i < comb_size_ * comb_size_; ++i)
+		{
+			auto inv = &inverse_[i * Lanes];
+			for (int lane = 0; lane < Lanes; ++lane)
+			{
+				finite_[lane] = finite_[lane] && std::isfinite(inv[lane]);
+			}
+		}
+	}
+};
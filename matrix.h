@@ -1,9 +1,33 @@
 #pragma once
+#include <algorithm>
+#include <limits>
+#include <type_traits>
 #include "eigen/Core"
+#include "eigen/LU"
+
+// The main matrix as the engines read it: either a dense matrix or memory mapped
+// from elsewhere, such as a shared-memory segment, without copying it.
+typedef Eigen::Ref<const Eigen::MatrixXd> main_matrix_t;
+
+// The gathers below read the main matrix only through m(r, c), so they also take
+// accessors that are not Eigen matrices, such as tiled_view_t in tiled.h. Those
+// are held by value in expressions and should be cheap views; Eigen matrices are
+// held as a main_matrix_t.
+template<class Main, bool = std::is_base_of<Eigen::EigenBase<Main>, Main>::value>
+struct main_holder_t
+{
+	typedef Main type;
+};
+
+template<class Main>
+struct main_holder_t<Main, true>
+{
+	typedef main_matrix_t type;
+};
 
 // A subset of row r from a matrix, selecting columns by the mapping column_map.
-template<int N>
-Eigen::RowVectorXd row_map(const Eigen::MatrixXd& m, int r, const std::array<int, N> column_map)
+template<class Main, class Map>
+Eigen::RowVectorXd row_map(const Main& m, int r, const Map& column_map)
 {
 	auto row = Eigen::RowVectorXd(column_map.size());
 	for (size_t c = 0; c < column_map.size(); ++c)
@@ -13,9 +37,19 @@ Eigen::RowVectorXd row_map(const Eigen::MatrixXd& m, int r, const std::array<int
 	return row;
 }
 
+// Gather a subset of row r into row without allocating; row must already have column_map.size() entries.
+template<class Main, class Map, class Row>
+void row_map(const Main& m, int r, const Map& column_map, Row& row)
+{
+	for (size_t c = 0; c < column_map.size(); ++c)
+	{
+		row[c] = m(r, column_map[c]);
+	}
+}
+
 // A subset of column c from a matrix, selecting rows by the mapping row_map.
-template<int N>
-Eigen::VectorXd col_map(const Eigen::MatrixXd& m, int c, const std::array<int, N> row_map)
+template<class Main, class Map>
+Eigen::VectorXd col_map(const Main& m, int c, const Map& row_map)
 {
 	auto col = Eigen::VectorXd(row_map.size());
 	for (size_t r = 0; r < row_map.size(); ++r)
@@ -25,6 +59,131 @@ Eigen::VectorXd col_map(const Eigen::MatrixXd& m, int c, const std::array<int, N
 	return col;
 }
 
+// Gather a subset of column c into col without allocating; col must already have row_map.size() entries.
+template<class Main, class Map, class Col>
+void col_map(const Main& m, int c, const Map& row_map, Col& col)
+{
+	for (size_t r = 0; r < row_map.size(); ++r)
+	{
+		col[r] = m(row_map[r], c);
+	}
+}
+
+// A single index, so one row or column can be selected through indexed_view
+struct single_index_t
+{
+	int index;
+
+	size_t size() const
+	{
+		return 1;
+	}
+
+	int operator[](size_t) const
+	{
+		return index;
+	}
+};
+
+// The mapping map with entry slot replaced by item, e.g. the mapping before a
+// swap given the one after it, without copying map
+template<class Map>
+struct replaced_index_t
+{
+	const Map& map;
+	int slot;
+	int item;
+
+	size_t size() const
+	{
+		return map.size();
+	}
+
+	int operator[](size_t i) const
+	{
+		return static_cast<int>(i) == slot ? item : map[i];
+	}
+};
+
+template<class Map>
+replaced_index_t<Map> replaced_index(const Map& map, int slot, int item)
+{
+	return { map, slot, item };
+}
+
+// How indexed_view holds a mapping: index views by value, containers by reference
+template<class Index>
+struct index_holder_t
+{
+	typedef const Index& type;
+};
+
+template<>
+struct index_holder_t<single_index_t>
+{
+	typedef single_index_t type;
+};
+
+template<class Map>
+struct index_holder_t<replaced_index_t<Map>>
+{
+	typedef replaced_index_t<Map> type;
+};
+
+// Functor of indexed_view: entry (r, c) is m(rows[r], cols[c])
+template<class Main, class Rows, class Cols>
+class indexed_view_op_t
+{
+	typename main_holder_t<Main>::type m_;
+	typename index_holder_t<Rows>::type rows_;
+	typename index_holder_t<Cols>::type cols_;
+
+public:
+	indexed_view_op_t(const Main& m, const Rows& rows, const Cols& cols)
+		:
+	m_(m),
+	rows_(rows),
+	cols_(cols)
+	{
+	}
+
+	double operator()(Eigen::Index r, Eigen::Index c) const
+	{
+		return m_(rows_[r], cols_[c]);
+	}
+};
+
+// A gather costs about one read, so Eigen nests indexed views in larger
+// expressions (e.g. partial reductions) instead of evaluating them to a temporary
+namespace Eigen
+{
+	namespace internal
+	{
+		template<class Main, class Rows, class Cols>
+		struct functor_traits<indexed_view_op_t<Main, Rows, Cols>>
+		{
+			enum { Cost = NumTraits<double>::ReadCost, PacketAccess = false, IsRepeatable = true };
+		};
+	}
+}
+
+// The submatrix of m selecting rows and columns by mappings, as an expression
+// that reads m where it is evaluated rather than a copy. Eigen 3.3 has no indexed
+// views, so this is a nullary expression gathering each entry. Mapping containers
+// are referenced and must outlive the expression, like m itself.
+template<class Main, class Rows, class Cols>
+Eigen::CwiseNullaryOp<indexed_view_op_t<Main, Rows, Cols>, Eigen::MatrixXd> indexed_view(const Main& m, const Rows& rows, const Cols& cols)
+{
+	return Eigen::MatrixXd::NullaryExpr(rows.size(), cols.size(), indexed_view_op_t<Main, Rows, Cols>(m, rows, cols));
+}
+
+// The principal submatrix of m selecting rows and columns by the mapping comb_map.
+template<class Main, class Map>
+Eigen::MatrixXd sub_matrix(const Main& m, const Map& comb_map)
+{
+	return indexed_view(m, comb_map, comb_map);
+}
+
 // Calculates (A+uv)^-1 given inv=A^-1
 // 
 // See Sherman, Jack; Morrison, Winifred J. (1949). "Adjustment of an Inverse Matrix Corresponding 
@@ -33,4 +192,95 @@ Eigen::VectorXd col_map(const Eigen::MatrixXd& m, int c, const std::array<int, N
 inline Eigen::MatrixXd sherman_morrison_update_inverse(const Eigen::MatrixXd& inv, const Eigen::VectorXd& u, const Eigen::RowVectorXd& v)
 {
 	return inv - (inv * u) * (v * inv) / (1 + v * inv * u);
-}
\ No newline at end of file
+}
+
+// Updates inv=A^-1 in place to the inverse of A with v added to row r, i.e. u=e_r.
+// inv_col and v_inv are workspace of the same size as inv, so nothing is allocated.
+// Dynamic or fixed-size matrices and vectors.
+template<class Matrix, class ColVector, class RowVector>
+void sherman_morrison_update_row(Matrix& inv, int r, const RowVector& v, ColVector& inv_col, RowVector& v_inv)
+{
+	inv_col = inv.col(r);
+	v_inv.noalias() = v * inv;
+	inv_col /= 1 + v_inv[r];
+	inv.noalias() -= inv_col * v_inv;
+}
+
+// Updates inv=A^-1 in place to the inverse of A with u added to column c, i.e. v=e_c.
+// inv_u and inv_row are workspace of the same size as inv, so nothing is allocated.
+template<class Matrix, class ColVector, class RowVector>
+void sherman_morrison_update_col(Matrix& inv, int c, const ColVector& u, ColVector& inv_u, RowVector& inv_row)
+{
+	inv_u.noalias() = inv * u;
+	inv_row = inv.row(c);
+	inv_u /= 1 + inv_u[c];
+	inv.noalias() -= inv_u * inv_row;
+}
+
+// As sherman_morrison_update_col, also returning the 1-norm of the updated inverse,
+// summed column by column while each column is still in cache.
+inline double sherman_morrison_update_col_norm(Eigen::MatrixXd& inv, int c, const Eigen::VectorXd& u, Eigen::VectorXd& inv_u, Eigen::RowVectorXd& inv_row)
+{
+	inv_u.noalias() = inv * u;
+	inv_row = inv.row(c);
+	inv_u /= 1 + inv_u[c];
+	auto norm = 0.0;
+	for (Eigen::Index j = 0; j < inv.cols(); ++j)
+	{
+		inv.col(j) -= inv_u * inv_row[j];
+		norm = std::max(norm, inv.col(j).lpNorm<1>());
+	}
+	return norm;
+}
+
+// Extends inv, the inverse of a symmetric m x m matrix A held in the top-left
+// corner, to the inverse of the bordered matrix [A b; b^T c]. w = A^-1 b and
+// s = c - b^T w is the Schur complement of A. inv must have room for m + 1.
+inline void border_inverse(Eigen::MatrixXd& inv, int m, const Eigen::VectorXd& w, double s)
+{
+	auto w_m = w.head(m);
+	inv.topLeftCorner(m, m).noalias() += (w_m / s) * w_m.transpose();
+	inv.block(0, m, m, 1) = -w_m / s;
+	inv.block(m, 0, 1, m) = -w_m.transpose() / s;
+	inv(m, m) = 1 / s;
+}
+
+// Undoes border_inverse, leaving the inverse of the leading m x m matrix in the
+// top-left corner of inv, which holds the inverse of the (m + 1) x (m + 1) matrix.
+inline void downdate_inverse(Eigen::MatrixXd& inv, int m)
+{
+	inv.topLeftCorner(m, m).noalias() -= (inv.block(0, m, m, 1) / inv(m, m)) * inv.block(m, 0, 1, m);
+}
+
+// True if a pivot of the LU factorisation lu vanishes relative to the largest,
+// which is how every engine decides that a combination is singular
+template<class LU>
+bool lu_singular(const LU& lu)
+{
+	auto pivots = lu.matrixLU().diagonal().cwiseAbs();
+	return pivots.size() > 0 && !(pivots.minCoeff() > pivots.maxCoeff() * pivots.size() * std::numeric_limits<double>::epsilon());
+}
+
+// The inverse of the matrix factored by lu into inverse, which must already have
+// its size and may be a block of a larger matrix. Solves in place against P as
+// PartialPivLU::inverse() does, but without the copies of the factorisation and
+// permutation mask that it allocates. Returns false, with inverse set to NaN,
+// if the matrix is singular by lu_singular or the inverse is not finite.
+template<class LU, class Inverse>
+bool lu_inverse(const LU& lu, Inverse&& inverse)
+{
+	const auto& permutation = lu.permutationP().indices();
+	inverse.setZero();
+	for (Eigen::Index j = 0; j < inverse.cols(); ++j)
+	{
+		inverse(permutation[j], j) = 1;
+	}
+	lu.matrixLU().template triangularView<Eigen::UnitLower>().solveInPlace(inverse);
+	lu.matrixLU().template triangularView<Eigen::Upper>().solveInPlace(inverse);
+	if (lu_singular(lu) || !inverse.allFinite())
+	{
+		inverse.setConstant(std::numeric_limits<double>::quiet_NaN());
+		return false;
+	}
+	return true;
+}
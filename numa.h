@@ -0,0 +1,248 @@
+#pragma once
+#ifdef __linux__
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <omp.h>
+#include <sched.h>
+#include "eigen/Core"
+
+#include "enumerate.h"
+#include "matrix.h"
+#include "schedule.h"
+
+// NUMA-aware parallel enumeration. Workers are pinned to cores by the topology
+// in sysfs, and every node gets its own copy of the main matrix and schedule,
+// made by one of its own workers so that first-touch places the pages on that
+// node. Engines are then constructed on their pinned worker, which places their
+// inverse and workspace locally too, so nothing in the steady state crosses the
+// interconnect. No libnuma is needed: placement relies on the kernel's default
+// local allocation policy.
+
+// The CPUs of each NUMA node that this process may run on
+struct numa_topology_t
+{
+	std::vector<std::vector<int>> nodes;
+
+	int cpu_count() const
+	{
+		auto count = 0;
+		for (const auto& cpus : nodes)
+		{
+			count += static_cast<int>(cpus.size());
+		}
+		return count;
+	}
+
+	// CPUs interleaved across nodes, so that a prefix of them spreads threads
+	// over every node's memory bandwidth rather than filling one node first
+	std::vector<int> interleaved() const
+	{
+		std::vector<int> cpus;
+		for (size_t i = 0; static_cast<int>(cpus.size()) < cpu_count(); ++i)
+		{
+			for (const auto& node : nodes)
+			{
+				if (i < node.size())
+				{
+					cpus.push_back(node[i]);
+				}
+			}
+		}
+		return cpus;
+	}
+
+	// Node of cpu, or -1
+	int node_of(int cpu) const
+	{
+		for (size_t n = 0; n < nodes.size(); ++n)
+		{
+			if (std::find(nodes[n].begin(), nodes[n].end(), cpu) != nodes[n].end())
+			{
+				return static_cast<int>(n);
+			}
+		}
+		return -1;
+	}
+};
+
+// Parse a sysfs CPU list such as "0-3,8-11"
+inline std::vector<int> parse_cpu_list(const std::string& list)
+{
+	std::vector<int> cpus;
+	std::stringstream in(list);
+	std::string range;
+	while (std::getline(in, range, ','))
+	{
+		auto dash = range.find('-');
+		try
+		{
+			auto first = std::stoi(range.substr(0, dash));
+			auto last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+			for (auto cpu = first; cpu <= last; ++cpu)
+			{
+				cpus.push_back(cpu);
+			}
+		}
+		catch (const std::exception&)
+		{
+		}
+	}
+	return cpus;
+}
+
+// Read the node topology from /sys/devices/system/node, keeping only CPUs in the
+// process's affinity mask and nodes left with any. Without sysfs everything is
+// one node.
+inline numa_topology_t read_numa_topology()
+{
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	sched_getaffinity(0, sizeof(allowed), &allowed);
+
+	numa_topology_t topology;
+	std::ifstream online("/sys/devices/system/node/online");
+	std::string nodes;
+	if (online >> nodes)
+	{
+		for (auto node : parse_cpu_list(nodes))
+		{
+			std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+			std::string list;
+			std::vector<int> cpus;
+			if (in >> list)
+			{
+				for (auto cpu : parse_cpu_list(list))
+				{
+					if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+					{
+						cpus.push_back(cpu);
+					}
+				}
+			}
+			if (!cpus.empty())
+			{
+				topology.nodes.push_back(cpus);
+			}
+		}
+	}
+	if (topology.nodes.empty())
+	{
+		std::vector<int> cpus;
+		for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+		{
+			if (CPU_ISSET(cpu, &allowed))
+			{
+				cpus.push_back(cpu);
+			}
+		}
+		topology.nodes.push_back(cpus);
+	}
+	return topology;
+}
+
+// Pins the calling thread to one CPU for its lifetime, restoring the previous
+// affinity afterwards so pooled OpenMP threads are not left pinned
+class thread_pin_t
+{
+	cpu_set_t previous_;
+	bool pinned_;
+
+public:
+	explicit thread_pin_t(int cpu)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		pinned_ = sched_getaffinity(0, sizeof(previous_), &previous_) == 0 && sched_setaffinity(0, sizeof(set), &set) == 0;
+	}
+
+	thread_pin_t(const thread_pin_t&) = delete;
+	thread_pin_t& operator=(const thread_pin_t&) = delete;
+
+	~thread_pin_t()
+	{
+		if (pinned_)
+		{
+			sched_setaffinity(0, sizeof(previous_), &previous_);
+		}
+	}
+};
+
+// What each node did in an enumerate_numa run
+struct numa_node_stats_t
+{
+	int threads = 0;
+	int64_t combinations = 0;
+
+	// Wall time of the node's slowest thread
+	double seconds = 0;
+
+	double throughput() const
+	{
+		return seconds > 0 ? combinations / seconds : 0;
+	}
+};
+
+// enumerate_openmp with workers pinned by topology and per-node replicas of main
+// and schedule. Ranges are split evenly per thread, as there. visit(thread,
+// engine) is called at every combination. Returns the work done per node.
+template<class Engine, class Visit>
+std::vector<numa_node_stats_t> enumerate_numa(const main_matrix_t& main, const schedule_t& schedule, const numa_topology_t& topology, int threads, Visit&& visit)
+{
+	threads = enumerate_threads(threads);
+	auto cpus = topology.interleaved();
+	std::vector<numa_node_stats_t> stats(topology.nodes.size());
+	std::vector<std::unique_ptr<const Eigen::MatrixXd>> mains(topology.nodes.size());
+	std::vector<std::unique_ptr<const schedule_t>> schedules(topology.nodes.size());
+
+	#pragma omp parallel num_threads(threads)
+	{
+		auto thread = omp_get_thread_num();
+		auto count = omp_get_num_threads();
+		auto node_of_thread = [&](int t)
+		{
+			return std::max(0, topology.node_of(cpus[t % cpus.size()]));
+		};
+		auto node = node_of_thread(thread);
+		thread_pin_t pin(cpus[thread % cpus.size()]);
+
+		// The first thread on each node replicates for it, after pinning
+		auto first = 0;
+		while (node_of_thread(first) != node)
+		{
+			++first;
+		}
+		if (thread == first)
+		{
+			mains[node].reset(new Eigen::MatrixXd(main));
+			schedules[node].reset(new schedule_t(schedule));
+		}
+		#pragma omp barrier
+
+		auto begin = schedule.combinations() * thread / count;
+		auto end = schedule.combinations() * (thread + 1) / count;
+		auto start = std::chrono::steady_clock::now();
+		{
+			Engine engine(*mains[node], *schedules[node]);
+			enumerate_range(engine, begin, end, [&](const Engine& e)
+			{
+				visit(thread, e);
+			});
+		}
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+		#pragma omp critical
+		{
+			stats[node].threads += 1;
+			stats[node].combinations += end - begin;
+			stats[node].seconds = std::max(stats[node].seconds, elapsed.count());
+		}
+	}
+	return stats;
+}
+#endif
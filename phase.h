@@ -0,0 +1,192 @@
+#pragma once
+#include <array>
+#include <cstdint>
+
+// Per-phase timers for the update loops. Define INVERT_PHASE_TIMERS to enable
+// them; otherwise PHASE_SCOPE expands to nothing and the loops are unchanged.
+
+// Phases of one step of an update engine
+enum phase_t
+{
+	phase_gray,
+	phase_mapping,
+	phase_gather,
+	phase_row_update,
+	phase_col_update,
+	phase_finite,
+	phase_count
+};
+
+inline const char* phase_name(int phase)
+{
+	static const char* names[] = { "gray", "mapping", "gather", "row-update", "col-update", "finite" };
+	return names[phase];
+}
+
+// Ticks spent in each phase and how many times it was entered
+struct phase_totals_t
+{
+	std::array<uint64_t, phase_count> ticks{};
+	std::array<uint64_t, phase_count> calls{};
+
+	phase_totals_t& operator+=(const phase_totals_t& other)
+	{
+		for (int phase = 0; phase < phase_count; ++phase)
+		{
+			ticks[phase] += other.ticks[phase];
+			calls[phase] += other.calls[phase];
+		}
+		return *this;
+	}
+};
+
+#ifdef INVERT_PHASE_TIMERS
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+const bool phase_timers_enabled = true;
+
+// Time stamp counter, or nanoseconds where there is none
+inline uint64_t phase_ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// Every thread's totals, so they can be merged once the work is done. Totals of
+// threads that have exited, or beyond the fixed capacity, are folded into retired.
+// Registration happens inside update loops, so it must not allocate.
+struct phase_registry_t
+{
+	std::mutex mutex;
+	std::array<phase_totals_t*, 256> threads{};
+	size_t count = 0;
+	phase_totals_t retired;
+};
+
+inline phase_registry_t& phase_registry()
+{
+	static phase_registry_t registry;
+	return registry;
+}
+
+// The calling thread's totals, registered on first use
+class phase_local_t
+{
+public:
+	phase_totals_t totals;
+
+	phase_local_t()
+	{
+		auto& registry = phase_registry();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		if (registry.count < registry.threads.size())
+		{
+			registry.threads[registry.count++] = &totals;
+		}
+	}
+
+	~phase_local_t()
+	{
+		auto& registry = phase_registry();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		registry.retired += totals;
+		auto end = registry.threads.begin() + registry.count;
+		auto found = std::find(registry.threads.begin(), end, &totals);
+		if (found != end)
+		{
+			*found = registry.threads[--registry.count];
+		}
+	}
+};
+
+inline phase_totals_t& phase_local()
+{
+	static thread_local phase_local_t local;
+	return local.totals;
+}
+
+// Set up the calling thread's totals, which allocates on first use
+inline void phase_thread_init()
+{
+	phase_local();
+}
+
+// Adds the time from construction to destruction to phase
+class phase_scope_t
+{
+	phase_t phase_;
+	uint64_t start_;
+
+public:
+	explicit phase_scope_t(phase_t phase)
+		:
+	phase_(phase),
+	start_(phase_ticks())
+	{
+	}
+
+	~phase_scope_t()
+	{
+		auto& totals = phase_local();
+		totals.ticks[phase_] += phase_ticks() - start_;
+		totals.calls[phase_] += 1;
+	}
+};
+
+// Sum over all threads. Call when no thread is inside a phase.
+inline phase_totals_t merge_phase_totals()
+{
+	auto& registry = phase_registry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	auto merged = registry.retired;
+	for (size_t i = 0; i < registry.count; ++i)
+	{
+		merged += *registry.threads[i];
+	}
+	return merged;
+}
+
+// Zero every thread's totals. Call when no thread is inside a phase.
+inline void reset_phase_totals()
+{
+	auto& registry = phase_registry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	registry.retired = phase_totals_t();
+	for (size_t i = 0; i < registry.count; ++i)
+	{
+		*registry.threads[i] = phase_totals_t();
+	}
+}
+
+#define PHASE_CONCAT_(a, b) a##b
+#define PHASE_CONCAT(a, b) PHASE_CONCAT_(a, b)
+#define PHASE_SCOPE(phase) phase_scope_t PHASE_CONCAT(phase_scope_, __LINE__)(phase)
+
+#else
+
+const bool phase_timers_enabled = false;
+
+inline void phase_thread_init()
+{
+}
+
+inline phase_totals_t merge_phase_totals()
+{
+	return phase_totals_t();
+}
+
+inline void reset_phase_totals()
+{
+}
+
+#define PHASE_SCOPE(phase)
+
+#endif
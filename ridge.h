@@ -0,0 +1,138 @@
+#pragma once
+#include <vector>
+#include "eigen/Dense"
+
+#include "matrix.h"
+#include "schedule.h"
+
+// Enumerates the combinations of a schedule for a symmetric main matrix and
+// gives (A_S + lambda I)^-1 for every lambda of a grid. One eigendecomposition
+// A_S = Q diag(e) Q^T per combination serves the whole grid, since
+// (A_S + lambda I)^-1 = Q diag(1 / (e + lambda)) Q^T:
+//   traces cost O(k) per lambda,
+//   solves cost one O(k^2) projection plus one k x k by k x L product for all lambdas,
+//   inverses cost O(k^3) per lambda, only when asked for.
+// Looping inverse() per lambda costs O(k^3) for each of them instead.
+//
+// The decomposition is recomputed at every combination. Updating it across a
+// swap means a symmetric rank-2 update of the eigenvectors, which is O(k^3)
+// like a fresh tridiagonalisation and much less stable, so it is not done.
+class ridge_engine_t
+{
+	main_matrix_t main_;
+	const schedule_t& schedule_;
+	int64_t rank_ = 0;
+	std::vector<int> comb_to_main_;
+
+	// The grid, as a row so it broadcasts across eigenvalues
+	Eigen::RowVectorXd lambdas_;
+
+	// Matrix for the current combination and its eigendecomposition
+	Eigen::MatrixXd combination_;
+	Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> solver_;
+
+	// Replacement row/column, sized once in seed
+	Eigen::RowVectorXd new_row_;
+	Eigen::VectorXd new_col_;
+
+	// Workspace for the queries, sized once in seed
+	mutable Eigen::VectorXd projected_;
+	mutable Eigen::MatrixXd scaled_;
+	mutable Eigen::MatrixXd scaled_vectors_;
+
+public:
+	// SelfAdjointEigenSolver allocates workspace for the tridiagonalisation on
+	// every compute; the queries below do not allocate
+	static const bool allocates_in_step = true;
+
+	ridge_engine_t(const main_matrix_t& main, const schedule_t& schedule, const std::vector<double>& lambdas)
+		:
+	main_(main),
+	schedule_(schedule),
+	lambdas_(Eigen::Map<const Eigen::RowVectorXd>(lambdas.data(), lambdas.size())),
+	solver_(schedule.comb_size())
+	{
+	}
+
+	void seed(int64_t rank)
+	{
+		rank_ = rank;
+		comb_to_main_ = schedule_.selection_at(rank);
+		combination_ = sub_matrix(main_, comb_to_main_);
+
+		auto n = comb_size();
+		new_row_.resize(n);
+		new_col_.resize(n);
+		projected_.resize(n);
+		scaled_.resize(n, lambdas_.size());
+		scaled_vectors_.resize(n, n);
+		solver_.compute(combination_);
+	}
+
+	// Replace the swapped row and column and decompose the new combination
+	void step()
+	{
+		const auto& swap = schedule_[rank_];
+		++rank_;
+		comb_to_main_[swap.slot] = swap.added;
+		row_map(main_, swap.added, comb_to_main_, new_row_);
+		col_map(main_, swap.added, comb_to_main_, new_col_);
+		combination_.row(swap.slot) = new_row_;
+		combination_.col(swap.slot) = new_col_;
+		solver_.compute(combination_);
+	}
+
+	int64_t rank() const
+	{
+		return rank_;
+	}
+
+	int comb_size() const
+	{
+		return schedule_.comb_size();
+	}
+
+	const std::vector<int>& comb_to_main() const
+	{
+		return comb_to_main_;
+	}
+
+	int lambda_count() const
+	{
+		return static_cast<int>(lambdas_.size());
+	}
+
+	const Eigen::VectorXd& eigenvalues() const
+	{
+		return solver_.eigenvalues();
+	}
+
+	// trace((A_S + lambda I)^-1) for every lambda; traces must have lambda_count() entries
+	void traces(Eigen::RowVectorXd& traces) const
+	{
+		const auto& e = solver_.eigenvalues();
+		for (Eigen::Index l = 0; l < lambdas_.size(); ++l)
+		{
+			traces[l] = (e.array() + lambdas_[l]).inverse().sum();
+		}
+	}
+
+	// Solve (A_S + lambda I) x = b for every lambda, one per column of x, which
+	// must be comb_size() x lambda_count()
+	void solve(const Eigen::VectorXd& b, Eigen::MatrixXd& x) const
+	{
+		const auto& q = solver_.eigenvectors();
+		projected_.noalias() = q.transpose() * b;
+		scaled_ = (solver_.eigenvalues().replicate(1, lambdas_.size()).rowwise() + lambdas_).cwiseInverse();
+		scaled_.array().colwise() *= projected_.array();
+		x.noalias() = q * scaled_;
+	}
+
+	// (A_S + lambda I)^-1 for lambda number l; inverse must be comb_size() square
+	void inverse(int l, Eigen::MatrixXd& inverse) const
+	{
+		const auto& q = solver_.eigenvectors();
+		scaled_vectors_ = q * (solver_.eigenvalues().array() + lambdas_[l]).inverse().matrix().asDiagonal();
+		inverse.noalias() = scaled_vectors_ * q.transpose();
+	}
+};
@@ -0,0 +1,357 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "gray.h"
+
+// A group of size items from which pick are selected
+struct group_t
+{
+	int size;
+	int pick;
+};
+
+inline bool operator==(const group_t& a, const group_t& b)
+{
+	return a.size == b.size && a.pick == b.pick;
+}
+
+// Largest group a schedule can hold, as Gray codes are 32-bit words
+const int max_group_size = 31;
+
+inline bool valid_group(const group_t& group)
+{
+	return group.pick >= 1 && group.pick <= group.size && group.size <= max_group_size;
+}
+
+// One step from a combination to the next: item removed is replaced by item added,
+// which takes over its row/column slot in the combination matrix.
+struct swap_t
+{
+	int32_t removed;
+	int32_t added;
+	int32_t slot;
+};
+
+// The sequence of swaps that enumerates every combination of a group layout,
+// where one item is picked from each group's Gray code. It only depends on the
+// shape, so it is built once and shared read-only between threads and main matrices.
+//
+// Groups are listed outermost first. The last group changes fastest and owns the
+// lowest item indices, matching the bit layout of gray_join_t.
+class schedule_t
+{
+	std::vector<group_t> groups_;
+	std::vector<int> initial_;
+	std::vector<swap_t> swaps_;
+
+public:
+	schedule_t(std::vector<group_t> groups, std::vector<int> initial, std::vector<swap_t> swaps)
+		:
+	groups_(std::move(groups)),
+	initial_(std::move(initial)),
+	swaps_(std::move(swaps))
+	{
+	}
+
+	const std::vector<group_t>& groups() const
+	{
+		return groups_;
+	}
+
+	// Number of items in the main matrix
+	int size() const
+	{
+		auto size = 0;
+		for (const auto& group : groups_)
+		{
+			size += group.size;
+		}
+		return size;
+	}
+
+	// Number of items in each combination
+	int comb_size() const
+	{
+		return static_cast<int>(initial_.size());
+	}
+
+	// Number of combinations, including the initial one
+	int64_t combinations() const
+	{
+		return static_cast<int64_t>(swaps_.size()) + 1;
+	}
+
+	// Index into the main matrix of each row/column of the first combination, ascending
+	const std::vector<int>& initial() const
+	{
+		return initial_;
+	}
+
+	// Swap leading from combination rank to rank + 1
+	const swap_t& operator[](int64_t rank) const
+	{
+		return swaps_[rank];
+	}
+
+	const std::vector<swap_t>& swaps() const
+	{
+		return swaps_;
+	}
+
+	// Index into the main matrix of each row/column of combination rank
+	std::vector<int> selection_at(int64_t rank) const
+	{
+		auto comb_to_main = initial_;
+		for (int64_t r = 0; r < rank; ++r)
+		{
+			comb_to_main[swaps_[r].slot] = swaps_[r].added;
+		}
+		return comb_to_main;
+	}
+
+	// Write the schedule in a compact binary form
+	void save(const std::string& path) const
+	{
+		std::ofstream out(path, std::ios::binary);
+		if (!out)
+		{
+			throw std::runtime_error("cannot write schedule " + path);
+		}
+		auto write = [&](const void* data, size_t bytes)
+		{
+			out.write(static_cast<const char*>(data), bytes);
+		};
+		uint64_t counts[] = { groups_.size(), initial_.size(), swaps_.size() };
+		write(magic(), 8);
+		write(counts, sizeof(counts));
+		write(groups_.data(), groups_.size() * sizeof(group_t));
+		write(initial_.data(), initial_.size() * sizeof(int));
+		write(swaps_.data(), swaps_.size() * sizeof(swap_t));
+		if (!out)
+		{
+			throw std::runtime_error("cannot write schedule " + path);
+		}
+	}
+
+	// Read a schedule written by save
+	static std::shared_ptr<const schedule_t> load(const std::string& path)
+	{
+		std::ifstream in(path, std::ios::binary);
+		if (!in)
+		{
+			throw std::runtime_error("cannot read schedule " + path);
+		}
+		auto read = [&](void* data, size_t bytes)
+		{
+			in.read(static_cast<char*>(data), bytes);
+			if (!in)
+			{
+				throw std::runtime_error("truncated schedule " + path);
+			}
+		};
+		char header[8];
+		uint64_t counts[3];
+		read(header, 8);
+		if (std::memcmp(header, magic(), 8) != 0)
+		{
+			throw std::runtime_error("not a schedule " + path);
+		}
+		read(counts, sizeof(counts));
+
+		// Check the counts against the file before allocating for them
+		auto start = in.tellg();
+		in.seekg(0, std::ios::end);
+		auto remaining = static_cast<uint64_t>(in.tellg() - start);
+		in.seekg(start);
+		if (counts[0] > remaining / sizeof(group_t) || counts[1] > remaining / sizeof(int) || counts[2] > remaining / sizeof(swap_t))
+		{
+			throw std::runtime_error("truncated schedule " + path);
+		}
+		std::vector<group_t> groups(counts[0]);
+		std::vector<int> initial(counts[1]);
+		std::vector<swap_t> swaps(counts[2]);
+		read(groups.data(), groups.size() * sizeof(group_t));
+		read(initial.data(), initial.size() * sizeof(int));
+		read(swaps.data(), swaps.size() * sizeof(swap_t));
+
+		// Engines index the main matrix and the combination with these unchecked
+		auto schedule = std::make_shared<const schedule_t>(std::move(groups), std::move(initial), std::move(swaps));
+		if (!schedule->valid())
+		{
+			throw std::runtime_error("corrupt schedule " + path);
+		}
+		return schedule;
+	}
+
+	// True if every group is valid and every index lies within the main matrix
+	// or the combination
+	bool valid() const
+	{
+		for (const auto& group : groups_)
+		{
+			if (!valid_group(group))
+			{
+				return false;
+			}
+		}
+		auto n = size();
+		auto k = comb_size();
+		for (auto item : initial_)
+		{
+			if (item < 0 || item >= n)
+			{
+				return false;
+			}
+		}
+		for (const auto& swap : swaps_)
+		{
+			if (swap.removed < 0 || swap.removed >= n || swap.added < 0 || swap.added >= n || swap.slot < 0 || swap.slot >= k)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+private:
+	static const char* magic()
+	{
+		return "INVSCH01";
+	}
+};
+
+// a * b, saturating at the largest int64_t for layouts with very many groups
+inline int64_t saturating_multiply(int64_t a, int64_t b)
+{
+	const auto max = std::numeric_limits<int64_t>::max();
+	return b != 0 && a > max / b ? max : a * b;
+}
+
+// Number of combinations of a group layout
+inline int64_t count_combinations(const std::vector<group_t>& groups)
+{
+	int64_t combinations = 1;
+	for (const auto& group : groups)
+	{
+		combinations = saturating_multiply(combinations, binomial(group.size, group.pick));
+	}
+	return combinations;
+}
+
+// Walk the joined Gray codes of groups and record each swap. The groups are joined
+// like gray_join_t: a group advances once every full pass of the groups inside it,
+// and those inner groups replay their sequence in reverse so only one item changes.
+// If max_combinations is non-zero the schedule is truncated to that many combinations.
+// Throws std::invalid_argument unless every group picks 1 to size items of at most
+// max_group_size, and if the swap table would have more entries than a vector
+// can hold, e.g. when the combination count saturates.
+inline std::shared_ptr<const schedule_t> make_schedule(const std::vector<group_t>& groups, int64_t max_combinations = 0)
+{
+	for (const auto& group : groups)
+	{
+		if (!valid_group(group))
+		{
+			throw std::invalid_argument("make_schedule: group of " + std::to_string(group.pick) + " from " + std::to_string(group.size) + " items");
+		}
+	}
+	std::vector<gray_generator_t> generators;
+	std::vector<int> offsets(groups.size());
+	std::vector<int64_t> strides(groups.size());
+	int64_t combinations = 1;
+	auto offset = 0;
+	for (auto g = groups.size(); g-- > 0;)
+	{
+		offsets[g] = offset;
+		strides[g] = combinations;
+		offset += groups[g].size;
+		combinations = saturating_multiply(combinations, binomial(groups[g].size, groups[g].pick));
+	}
+	for (const auto& group : groups)
+	{
+		generators.emplace_back(group.size, group.pick);
+	}
+	if (max_combinations > 0 && max_combinations < combinations)
+	{
+		combinations = max_combinations;
+	}
+
+	// Initial selection and its mapping onto the combination matrix
+	std::vector<int> main_to_comb(offset, -1);
+	std::vector<int> initial;
+	for (auto g = groups.size(); g-- > 0;)
+	{
+		auto value = generators[g].value();
+		for (auto i = 0; i < groups[g].size; ++i)
+		{
+			if (value >> i & 1)
+			{
+				main_to_comb[offsets[g] + i] = static_cast<int>(initial.size());
+				initial.push_back(offsets[g] + i);
+			}
+		}
+	}
+
+	std::vector<swap_t> swaps;
+	if (static_cast<uint64_t>(combinations - 1) > swaps.max_size())
+	{
+		throw std::invalid_argument("make_schedule: too many combinations for a swap table, pass max_combinations");
+	}
+	swaps.reserve(combinations - 1);
+	for (int64_t count = 1; count < combinations; ++count)
+	{
+		swap_t swap = { -1, -1, -1 };
+		for (size_t g = 0; g < groups.size(); ++g)
+		{
+			if (count % strides[g] != 0)
+			{
+				continue;
+			}
+			auto value = generators[g].value();
+			generators[g].next();
+			auto value_next = generators[g].value();
+			if (value != value_next)
+			{
+				swap.removed = offsets[g] + set_bit(value & ~value_next);
+				swap.added = offsets[g] + set_bit(value_next & ~value);
+			}
+		}
+		swap.slot = main_to_comb[swap.removed];
+		main_to_comb[swap.removed] = -1;
+		main_to_comb[swap.added] = swap.slot;
+		swaps.push_back(swap);
+	}
+
+	return std::make_shared<const schedule_t>(groups, std::move(initial), std::move(swaps));
+}
+
+// Load the schedule for groups from path, building and saving it there if the file
+// is missing or was built for a different shape.
+inline std::shared_ptr<const schedule_t> load_or_make_schedule(const std::vector<group_t>& groups, const std::string& path, int64_t max_combinations = 0)
+{
+	try
+	{
+		auto schedule = schedule_t::load(path);
+		auto expected = count_combinations(groups);
+		if (max_combinations > 0 && max_combinations < expected)
+		{
+			expected = max_combinations;
+		}
+		if (schedule->groups() == groups && schedule->combinations() == expected)
+		{
+			return schedule;
+		}
+	}
+	catch (const std::runtime_error&)
+	{
+	}
+	auto schedule = make_schedule(groups, max_combinations);
+	schedule->save(path);
+	return schedule;
+}
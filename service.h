@@ -0,0 +1,413 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <future>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "eigen/Dense"
+
+#include "enumerate.h"
+#include "matrix.h"
+#include "schedule.h"
+#include "sherman.h"
+
+// Asynchronous enumeration for services answering many small requests. A
+// persistent pool of workers takes jobs from submit() and completes their
+// futures, so no thread team, schedule or engine is built per request:
+//   schedules are built once per group layout and cached,
+//   each worker keeps a warm engine per layout, with its workspace and a copy
+//   of the main matrix that later jobs overwrite in place,
+//   small jobs are batched onto one worker's queue, large ones are split into
+//   ranges that idle workers steal.
+
+// One enumeration request: the combinations [begin, end) of a group layout over
+// main, where end of -1 means all of them
+struct invert_job_t
+{
+	std::vector<group_t> groups;
+	Eigen::MatrixXd main;
+	int64_t begin = 0;
+	int64_t end = -1;
+};
+
+// What a job found. The smallest trace of an inverse is the usual objective,
+// see bnb.h. latency is from submit() to completion, including queueing.
+struct invert_job_result_t
+{
+	int64_t combinations = 0;
+	int64_t finite = 0;
+	double trace_sum = 0;
+	double best_trace = std::numeric_limits<double>::infinity();
+	int64_t best_rank = -1;
+	double latency = 0;
+};
+
+// Schedules by group layout, shared between jobs and never evicted. A layout's
+// schedule only covers the combinations jobs have asked for so far, so a job
+// wanting the first few of a huge layout does not build its whole swap table;
+// it is rebuilt longer, at least doubling, when a job needs more. Schedules are
+// built outside the lock, so a slow build does not hold up other submits, and
+// two jobs missing on one layout at once may both build it.
+class schedule_cache_t
+{
+	std::mutex mutex_;
+	std::map<std::vector<int>, std::shared_ptr<const schedule_t>> schedules_;
+
+public:
+	// A schedule for groups with at least needed combinations, or all of them if
+	// there are fewer. Throws std::invalid_argument for the groups make_schedule
+	// rejects.
+	std::shared_ptr<const schedule_t> get(const std::vector<group_t>& groups, int64_t needed)
+	{
+		std::vector<int> key;
+		for (const auto& group : groups)
+		{
+			key.push_back(group.size);
+			key.push_back(group.pick);
+		}
+		auto total = count_combinations(groups);
+		needed = std::min(std::max<int64_t>(needed, 1), total);
+		int64_t cached = 0;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			auto found = schedules_.find(key);
+			if (found != schedules_.end())
+			{
+				if (found->second->combinations() >= needed)
+				{
+					return found->second;
+				}
+				cached = found->second->combinations();
+			}
+		}
+
+		auto length = cached > total / 2 ? total : std::max(needed, 2 * cached);
+		auto schedule = make_schedule(groups, length);
+		std::lock_guard<std::mutex> lock(mutex_);
+		auto& slot = schedules_[key];
+		if (!slot || slot->combinations() < schedule->combinations())
+		{
+			slot = schedule;
+		}
+		return slot;
+	}
+};
+
+struct invert_service_options_t
+{
+	// Zero means one per hardware thread
+	int workers = 0;
+
+	// Jobs of at most batch_combinations go to the current batch worker until it
+	// has batch_size of them queued; larger jobs are split into ranges of
+	// split_combinations spread over all workers
+	int64_t batch_combinations = 4096;
+	int batch_size = 8;
+	int64_t split_combinations = 16384;
+};
+
+class invert_service_t
+{
+	struct job_state_t
+	{
+		std::shared_ptr<const schedule_t> schedule;
+		Eigen::MatrixXd main;
+		std::chrono::steady_clock::time_point submitted;
+		std::promise<invert_job_result_t> promise;
+		std::mutex mutex;
+		invert_job_result_t result;
+		std::exception_ptr error;
+		int remaining;
+	};
+
+	struct task_t
+	{
+		std::shared_ptr<job_state_t> job;
+		int64_t begin;
+		int64_t end;
+	};
+
+	// A worker's engine for one layout, over its own copy of the main matrix.
+	// A worker keeps at most warm_layouts of them.
+	static const size_t warm_layouts = 16;
+
+	// The engine refers to schedule, so it is held here too: a cached schedule
+	// that was rebuilt longer may have no jobs left using it.
+	struct warm_engine_t
+	{
+		std::shared_ptr<const schedule_t> schedule;
+		Eigen::MatrixXd main;
+		std::unique_ptr<sherman_engine_t> engine;
+	};
+
+	struct worker_t
+	{
+		std::mutex mutex;
+		std::deque<task_t> tasks;
+		std::map<const schedule_t*, warm_engine_t> warm;
+		std::thread thread;
+	};
+
+	invert_service_options_t options_;
+	schedule_cache_t schedules_;
+	std::vector<std::unique_ptr<worker_t>> workers_;
+
+	// Tasks queued but not yet taken, and the sleep of idle workers
+	std::mutex wake_mutex_;
+	std::condition_variable wake_;
+	int64_t pending_ = 0;
+	bool stop_ = false;
+
+	// Where the next small job goes, and how many it already has
+	std::mutex batch_mutex_;
+	size_t batch_worker_ = 0;
+	int batch_count_ = 0;
+	size_t next_worker_ = 0;
+
+	void push(size_t worker, task_t task)
+	{
+		{
+			std::lock_guard<std::mutex> lock(workers_[worker]->mutex);
+			workers_[worker]->tasks.push_back(std::move(task));
+		}
+		{
+			std::lock_guard<std::mutex> lock(wake_mutex_);
+			++pending_;
+		}
+		wake_.notify_one();
+	}
+
+	// The newest task of worker's own queue, or else the oldest of another's
+	bool take(size_t worker, task_t& task)
+	{
+		for (size_t i = 0; i < workers_.size(); ++i)
+		{
+			auto& victim = *workers_[(worker + i) % workers_.size()];
+			std::lock_guard<std::mutex> lock(victim.mutex);
+			if (victim.tasks.empty())
+			{
+				continue;
+			}
+			if (i == 0)
+			{
+				task = std::move(victim.tasks.back());
+				victim.tasks.pop_back();
+			}
+			else
+			{
+				task = std::move(victim.tasks.front());
+				victim.tasks.pop_front();
+			}
+			std::lock_guard<std::mutex> wake_lock(wake_mutex_);
+			--pending_;
+			return true;
+		}
+		return false;
+	}
+
+	void run(size_t index)
+	{
+		auto& worker = *workers_[index];
+		for (;;)
+		{
+			task_t task;
+			if (take(index, task))
+			{
+				execute(worker, task);
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(wake_mutex_);
+			wake_.wait(lock, [&]() { return stop_ || pending_ > 0; });
+			if (stop_ && pending_ == 0)
+			{
+				return;
+			}
+		}
+	}
+
+	// Run task, keeping the first exception of its job for the future rather
+	// than letting it end the worker thread
+	void execute(worker_t& worker, const task_t& task)
+	{
+		auto& job = *task.job;
+		invert_job_result_t partial;
+		std::exception_ptr error;
+		try
+		{
+			partial = enumerate_task(worker, task);
+		}
+		catch (...)
+		{
+			// The warm engine may be half built or half seeded
+			worker.warm.erase(job.schedule.get());
+			error = std::current_exception();
+		}
+
+		std::lock_guard<std::mutex> lock(job.mutex);
+		auto& result = job.result;
+		if (error && !job.error)
+		{
+			job.error = error;
+		}
+		result.combinations += partial.combinations;
+		result.finite += partial.finite;
+		result.trace_sum += partial.trace_sum;
+		if (partial.best_trace < result.best_trace || (partial.best_trace == result.best_trace && partial.best_rank < result.best_rank))
+		{
+			result.best_trace = partial.best_trace;
+			result.best_rank = partial.best_rank;
+		}
+		if (--job.remaining == 0)
+		{
+			if (job.error)
+			{
+				job.promise.set_exception(job.error);
+				return;
+			}
+			std::chrono::duration<double> latency = std::chrono::steady_clock::now() - job.submitted;
+			result.latency = latency.count();
+			job.promise.set_value(result);
+		}
+	}
+
+	invert_job_result_t enumerate_task(worker_t& worker, const task_t& task)
+	{
+		auto& job = *task.job;
+		if (worker.warm.size() >= warm_layouts && !worker.warm.count(job.schedule.get()))
+		{
+			worker.warm.clear();
+		}
+		auto& warm = worker.warm[job.schedule.get()];
+		if (!warm.engine)
+		{
+			warm.schedule = job.schedule;
+			warm.main.resize(job.main.rows(), job.main.cols());
+			warm.engine.reset(new sherman_engine_t(warm.main, *job.schedule));
+		}
+
+		// Same size, so this copies into the storage the engine already reads
+		warm.main = job.main;
+
+		invert_job_result_t partial;
+		enumerate_range(*warm.engine, task.begin, task.end, [&](const sherman_engine_t& engine)
+		{
+			auto trace = engine.inverse().trace();
+			++partial.combinations;
+			if (std::isfinite(trace))
+			{
+				++partial.finite;
+				partial.trace_sum += trace;
+				if (trace < partial.best_trace)
+				{
+					partial.best_trace = trace;
+					partial.best_rank = engine.rank();
+				}
+			}
+		});
+		return partial;
+	}
+
+public:
+	explicit invert_service_t(const invert_service_options_t& options = invert_service_options_t())
+		:
+	options_(options)
+	{
+		auto workers = options.workers > 0 ? options.workers : std::max(1u, std::thread::hardware_concurrency());
+		for (unsigned w = 0; w < static_cast<unsigned>(workers); ++w)
+		{
+			workers_.emplace_back(new worker_t());
+		}
+		for (size_t w = 0; w < workers_.size(); ++w)
+		{
+			workers_[w]->thread = std::thread([this, w]() { run(w); });
+		}
+	}
+
+	invert_service_t(const invert_service_t&) = delete;
+	invert_service_t& operator=(const invert_service_t&) = delete;
+
+	// Finishes the jobs already submitted
+	~invert_service_t()
+	{
+		{
+			std::lock_guard<std::mutex> lock(wake_mutex_);
+			stop_ = true;
+		}
+		wake_.notify_all();
+		for (auto& worker : workers_)
+		{
+			worker->thread.join();
+		}
+	}
+
+	int workers() const
+	{
+		return static_cast<int>(workers_.size());
+	}
+
+	// Queue a job. Throws std::invalid_argument if a group is invalid, see make_schedule,
+	// or main does not match the layout.
+	std::future<invert_job_result_t> submit(invert_job_t job)
+	{
+		for (const auto& group : job.groups)
+		{
+			if (!valid_group(group))
+			{
+				throw std::invalid_argument("invert_service_t: invalid group");
+			}
+		}
+		auto state = std::make_shared<job_state_t>();
+		state->submitted = std::chrono::steady_clock::now();
+		auto combinations = count_combinations(job.groups);
+		auto end = job.end < 0 ? combinations : std::min(job.end, combinations);
+		state->schedule = schedules_.get(job.groups, end);
+		if (job.main.rows() != state->schedule->size() || job.main.cols() != state->schedule->size())
+		{
+			throw std::invalid_argument("invert_service_t: main matrix does not match the groups");
+		}
+		state->main = std::move(job.main);
+		auto begin = std::min(std::max<int64_t>(job.begin, 0), end);
+		auto future = state->promise.get_future();
+
+		if (end - begin <= options_.batch_combinations)
+		{
+			state->remaining = 1;
+			size_t worker;
+			{
+				std::lock_guard<std::mutex> lock(batch_mutex_);
+				if (batch_count_ == options_.batch_size)
+				{
+					batch_worker_ = (batch_worker_ + 1) % workers_.size();
+					batch_count_ = 0;
+				}
+				++batch_count_;
+				worker = batch_worker_;
+			}
+			push(worker, { state, begin, end });
+			return future;
+		}
+
+		auto tasks = (end - begin + options_.split_combinations - 1) / options_.split_combinations;
+		state->remaining = static_cast<int>(tasks);
+		for (int64_t t = 0; t < tasks; ++t)
+		{
+			size_t worker;
+			{
+				std::lock_guard<std::mutex> lock(batch_mutex_);
+				worker = next_worker_++ % workers_.size();
+			}
+			push(worker, { state, begin + (end - begin) * t / tasks, begin + (end - begin) * (t + 1) / tasks });
+		}
+		return future;
+	}
+};
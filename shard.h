@@ -0,0 +1,422 @@
+#pragma once
+#ifdef __linux__
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "eigen/Core"
+
+#include "enumerate.h"
+#include "matrix.h"
+#include "schedule.h"
+
+// Multi-process enumeration. The rank space of a schedule is split into shards,
+// which a coordinator hands out to forked worker processes over Unix sockets as
+// they finish the previous one. Workers map the main matrix read-only from a
+// shared-memory segment and write each shard's reduction to that shard's slot of
+// a second, shared results segment. The sockets stand in for a network, so the
+// same protocol could drive workers on other machines.
+
+struct shard_options_t
+{
+	// Worker processes, or one per OpenMP thread if zero or less
+	int workers = 0;
+
+	// Shards the rank space is split into, or four per worker if zero or less
+	int shards = 0;
+
+	// Where the coordinator reports progress, and how often
+	std::ostream* progress = nullptr;
+	double progress_seconds = 1;
+};
+
+template<class Reduction>
+struct shard_result_t
+{
+	// Merged reduction of every shard, in shard order
+	Reduction reduction{};
+	int64_t combinations = 0;
+	int workers = 0;
+	int shards = 0;
+
+	// Shards handed out again because their worker exited before finishing them
+	int reassigned = 0;
+};
+
+// How a shared_segment_t is opened
+enum shared_access_t
+{
+	shared_create,
+	shared_read_only,
+	shared_read_write
+};
+
+// A POSIX shared-memory segment mapped into this process. The process that
+// creates it unlinks the name again when done.
+class shared_segment_t
+{
+	std::string name_;
+	void* data_ = MAP_FAILED;
+	size_t size_ = 0;
+	bool owner_ = false;
+
+public:
+	// size is only used by shared_create; opening takes the size of the segment
+	shared_segment_t(const std::string& name, shared_access_t access, size_t size = 0)
+		:
+	name_(name),
+	owner_(access == shared_create)
+	{
+		auto flags = access == shared_create ? O_CREAT | O_EXCL | O_RDWR : access == shared_read_only ? O_RDONLY : O_RDWR;
+		auto fd = shm_open(name.c_str(), flags, 0600);
+		if (fd < 0)
+		{
+			throw std::runtime_error("cannot open shared memory " + name);
+		}
+		struct stat status;
+		if (owner_ ? ftruncate(fd, size) != 0 : fstat(fd, &status) != 0)
+		{
+			close(fd);
+			release();
+			throw std::runtime_error("cannot size shared memory " + name);
+		}
+		size_ = owner_ ? size : static_cast<size_t>(status.st_size);
+		auto protection = access == shared_read_only ? PROT_READ : PROT_READ | PROT_WRITE;
+		data_ = size_ ? mmap(nullptr, size_, protection, MAP_SHARED, fd, 0) : nullptr;
+		close(fd);
+		if (data_ == MAP_FAILED)
+		{
+			release();
+			throw std::runtime_error("cannot map shared memory " + name);
+		}
+	}
+
+	shared_segment_t(const shared_segment_t&) = delete;
+	shared_segment_t& operator=(const shared_segment_t&) = delete;
+
+	~shared_segment_t()
+	{
+		release();
+	}
+
+	void* data() const
+	{
+		return data_;
+	}
+
+	size_t size() const
+	{
+		return size_;
+	}
+
+private:
+	void release()
+	{
+		if (data_ != MAP_FAILED && data_ != nullptr)
+		{
+			munmap(data_, size_);
+		}
+		data_ = MAP_FAILED;
+		if (owner_)
+		{
+			shm_unlink(name_.c_str());
+			owner_ = false;
+		}
+	}
+};
+
+// The main matrix segment starts with its dimensions, with the column-major
+// entries at shard_main_offset
+struct shard_main_header_t
+{
+	int64_t rows;
+	int64_t cols;
+};
+
+const size_t shard_main_offset = 64;
+
+// One shard's output in the results segment, on its own cache lines
+template<class Reduction>
+struct alignas(64) shard_slot_t
+{
+	Reduction reduction;
+	int64_t combinations;
+};
+
+// Messages from a worker to the coordinator. A request or a finished shard asks
+// for the next shard, which the coordinator answers with its index, or -1 to stop.
+enum shard_message_kind_t : int32_t
+{
+	shard_request,
+	shard_progress,
+	shard_finished
+};
+
+struct shard_message_t
+{
+	int32_t kind;
+	int32_t shard;
+
+	// Combinations of the shard visited so far
+	int64_t done;
+};
+
+// Combinations a worker visits between progress messages
+const int64_t shard_progress_interval = 1 << 16;
+
+// Ranks [begin, end) of a shard
+inline int64_t shard_begin(const schedule_t& schedule, int shard, int shards)
+{
+	return schedule.combinations() * shard / shards;
+}
+
+// Send or receive exactly one value over a socket, returning false if the peer has gone
+template<class T>
+bool shard_send(int socket, const T& value)
+{
+	return send(socket, &value, sizeof(value), MSG_NOSIGNAL) == static_cast<ssize_t>(sizeof(value));
+}
+
+template<class T>
+bool shard_receive(int socket, T& value)
+{
+	ssize_t count;
+	do
+	{
+		count = recv(socket, &value, sizeof(value), 0);
+	} while (count < 0 && errno == EINTR);
+	return count == static_cast<ssize_t>(sizeof(value));
+}
+
+// Body of a worker process: map the segments, then run shards until told to stop.
+// visit(reduction, engine) is called at every combination, as in enumerate_checkpointed.
+template<class Engine, class Reduction, class Visit>
+void shard_worker(int socket, const std::string& main_name, const std::string& results_name, const schedule_t& schedule, int shards, Visit& visit)
+{
+	// The forked process must not start OpenMP teams of its own
+	Eigen::setNbThreads(1);
+
+	shared_segment_t main_segment(main_name, shared_read_only);
+	shared_segment_t results_segment(results_name, shared_read_write);
+	auto bytes = static_cast<const char*>(main_segment.data());
+	auto header = reinterpret_cast<const shard_main_header_t*>(bytes);
+	Eigen::Map<const Eigen::MatrixXd> main(reinterpret_cast<const double*>(bytes + shard_main_offset), header->rows, header->cols);
+	auto slots = static_cast<shard_slot_t<Reduction>*>(results_segment.data());
+
+	Engine engine(main, schedule);
+	shard_message_t message = { shard_request, -1, 0 };
+	int32_t shard;
+	while (shard_send(socket, message) && shard_receive(socket, shard) && shard >= 0)
+	{
+		Reduction reduction{};
+		int64_t done = 0;
+		enumerate_range(engine, shard_begin(schedule, shard, shards), shard_begin(schedule, shard + 1, shards), [&](const Engine& e)
+		{
+			visit(reduction, e);
+			if (++done % shard_progress_interval == 0)
+			{
+				shard_send(socket, shard_message_t{ shard_progress, shard, done });
+			}
+		});
+		slots[shard].reduction = reduction;
+		slots[shard].combinations = done;
+		message = { shard_finished, shard, done };
+	}
+}
+
+// Enumerate the schedule across worker processes, calling visit(reduction, engine)
+// at every combination with a trivially copyable Reduction per shard. The shard
+// reductions are combined with merge(total, shard) in shard order, so the result
+// does not depend on which worker ran which shard. A shard whose worker exits
+// early is handed to another worker; throws if no worker is left to run it.
+template<class Engine, class Reduction, class Visit, class Merge>
+shard_result_t<Reduction> enumerate_sharded(const main_matrix_t& main, const schedule_t& schedule, const shard_options_t& options, Visit visit, Merge merge)
+{
+	static_assert(std::is_trivially_copyable<Reduction>::value, "shard reductions are shared as bytes");
+	shard_result_t<Reduction> result;
+	result.workers = options.workers > 0 ? options.workers : enumerate_threads(0);
+	result.shards = options.shards > 0 ? options.shards : 4 * result.workers;
+
+	// Segment names only need to be unique among concurrent runs on this machine
+	auto suffix = std::to_string(getpid());
+	shared_segment_t main_segment("/invert-main-" + suffix, shared_create, shard_main_offset + main.size() * sizeof(double));
+	shared_segment_t results_segment("/invert-results-" + suffix, shared_create, result.shards * sizeof(shard_slot_t<Reduction>));
+	auto bytes = static_cast<char*>(main_segment.data());
+	*reinterpret_cast<shard_main_header_t*>(bytes) = { main.rows(), main.cols() };
+	Eigen::Map<Eigen::MatrixXd>(reinterpret_cast<double*>(bytes + shard_main_offset), main.rows(), main.cols()) = main;
+
+	struct worker_t
+	{
+		pid_t pid;
+		int socket;
+		int shard;
+		int64_t done;
+	};
+	std::vector<worker_t> workers;
+
+	// Closes every socket and reaps every worker, also when unwinding
+	struct reaper_t
+	{
+		std::vector<worker_t>& workers;
+
+		~reaper_t()
+		{
+			for (auto& worker : workers)
+			{
+				if (worker.socket >= 0)
+				{
+					close(worker.socket);
+				}
+				waitpid(worker.pid, nullptr, 0);
+			}
+		}
+	} reaper{ workers };
+
+	std::fflush(nullptr);
+	std::cout.flush();
+	std::cerr.flush();
+	for (int i = 0; i < result.workers; ++i)
+	{
+		int sockets[2];
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sockets) != 0)
+		{
+			throw std::runtime_error("cannot create a worker socket");
+		}
+		auto pid = fork();
+		if (pid < 0)
+		{
+			close(sockets[0]);
+			close(sockets[1]);
+			throw std::runtime_error("cannot start a worker process");
+		}
+		if (pid == 0)
+		{
+			close(sockets[0]);
+			for (auto& worker : workers)
+			{
+				close(worker.socket);
+			}
+			auto status = 0;
+			try
+			{
+				shard_worker<Engine, Reduction>(sockets[1], "/invert-main-" + suffix, "/invert-results-" + suffix, schedule, result.shards, visit);
+			}
+			catch (const std::exception& e)
+			{
+				std::cerr << "shard worker: " << e.what() << std::endl;
+				status = 1;
+			}
+			// Skip the parent's exit handlers and destructors
+			std::fflush(nullptr);
+			_exit(status);
+		}
+		close(sockets[1]);
+		workers.push_back({ pid, sockets[0], -1, 0 });
+	}
+
+	std::deque<int> pending;
+	for (int shard = 0; shard < result.shards; ++shard)
+	{
+		pending.push_back(shard);
+	}
+	auto finished = 0;
+	auto last_report = std::chrono::steady_clock::now();
+	std::vector<pollfd> polls;
+	while (finished < result.shards)
+	{
+		polls.clear();
+		for (const auto& worker : workers)
+		{
+			polls.push_back({ worker.socket, POLLIN, 0 });
+		}
+		auto timeout = options.progress ? static_cast<int>(options.progress_seconds * 1000) : -1;
+		if (poll(polls.data(), polls.size(), timeout) < 0 && errno != EINTR)
+		{
+			throw std::runtime_error("cannot poll worker sockets");
+		}
+
+		for (size_t i = 0; i < workers.size(); ++i)
+		{
+			auto& worker = workers[i];
+			if (worker.socket < 0 || !(polls[i].revents & (POLLIN | POLLHUP | POLLERR)))
+			{
+				continue;
+			}
+			shard_message_t message;
+			if (!shard_receive(worker.socket, message))
+			{
+				// The worker has exited, so its shard starts over elsewhere
+				if (worker.shard >= 0)
+				{
+					pending.push_front(worker.shard);
+					++result.reassigned;
+				}
+				close(worker.socket);
+				worker.socket = -1;
+				worker.shard = -1;
+				continue;
+			}
+			if (message.kind == shard_progress)
+			{
+				worker.done = message.done;
+				continue;
+			}
+			if (message.kind == shard_finished)
+			{
+				++finished;
+				result.combinations += message.done;
+			}
+			worker.done = 0;
+			worker.shard = -1;
+			if (!pending.empty())
+			{
+				worker.shard = pending.front();
+				pending.pop_front();
+			}
+			shard_send(worker.socket, static_cast<int32_t>(worker.shard));
+		}
+
+		auto live = std::count_if(workers.begin(), workers.end(), [](const worker_t& worker) { return worker.socket >= 0; });
+		if (live == 0 && finished < result.shards)
+		{
+			throw std::runtime_error("every shard worker exited before the enumeration finished");
+		}
+
+		auto now = std::chrono::steady_clock::now();
+		if (options.progress && std::chrono::duration<double>(now - last_report).count() >= options.progress_seconds)
+		{
+			auto visited = result.combinations;
+			for (const auto& worker : workers)
+			{
+				visited += worker.done;
+			}
+			*options.progress << finished << "/" << result.shards << " shards, " << visited << "/" << schedule.combinations()
+				<< " combinations, " << live << " workers" << std::endl;
+			last_report = now;
+		}
+	}
+
+	auto slots = static_cast<const shard_slot_t<Reduction>*>(results_segment.data());
+	for (int shard = 0; shard < result.shards; ++shard)
+	{
+		merge(result.reduction, slots[shard].reduction);
+	}
+	return result;
+}
+
+#endif
@@ -0,0 +1,395 @@
+#pragma once
+#include <cmath>
+#include <limits>
+#include <vector>
+#include "eigen/Dense"
+
+#include "matrix.h"
+#include "phase.h"
+#include "schedule.h"
+
+// How often sherman_engine_t left the fast path of a row then a column update
+struct sherman_fallbacks_t
+{
+	// Swaps applied column first, or as one rank-2 update, to avoid a near
+	// singular intermediate matrix
+	int64_t reordered = 0;
+	int64_t fused = 0;
+
+	// Swaps replaced by a direct inversion of the new combination
+	int64_t direct = 0;
+
+	// Combinations found to be singular, including at a seed
+	int64_t singular = 0;
+};
+
+// Operands of one sherman_engine_t step, gathered from the main matrix ahead of
+// the update, see stream.h
+struct gathered_swap_t
+{
+	swap_t swap;
+	Eigen::RowVectorXd new_row;
+	Eigen::VectorXd new_col;
+	Eigen::RowVectorXd v_row;
+	Eigen::VectorXd u_col;
+};
+
+// Gather the replacement row and column of swap, with comb_to_main already
+// holding the added item, and their changes for a row then column update: the
+// row against the old combination, and the column against the new rows. The old
+// entries are read from the main matrix with the removed item back in its slot.
+template<class Main, class Map, class Row, class Col>
+void gather_swap(const Main& main, const swap_t& swap, const Map& comb_to_main, Row& new_row, Col& new_col, Row& v_row, Col& u_col)
+{
+	row_map(main, swap.added, comb_to_main, new_row);
+	col_map(main, swap.added, comb_to_main, new_col);
+	v_row = new_row - indexed_view(main, single_index_t{ swap.removed }, replaced_index(comb_to_main, swap.slot, swap.removed));
+	u_col = new_col - indexed_view(main, comb_to_main, single_index_t{ swap.removed });
+	u_col[swap.slot] = 0;
+}
+
+// Enumerates the combinations of a schedule for one main matrix. The inverse is
+// computed directly at the seed combination and then updated with two
+// Sherman-Morrison rank-1 updates per swap, as in eigen_sherman. The schedule is
+// only read, so any number of engines can share it.
+//
+// Main is how the main matrix is read, a main_matrix_t for sherman_engine_t, or
+// any accessor with m(r, c) such as the tiled file view of tiled.h.
+template<class Main>
+class basic_sherman_engine_t
+{
+	Main main_;
+	const schedule_t& schedule_;
+	int64_t rank_ = 0;
+
+	// Index into the main matrix of each row/column of the combination
+	std::vector<int> comb_to_main_;
+
+	// Inverse of the current combination. The combination itself is only read
+	// from the main matrix through indexed_view, never copied.
+	Eigen::MatrixXd inverse_;
+
+	// Replacement row/column, update vectors and workspace, sized once in seed
+	Eigen::RowVectorXd new_row_;
+	Eigen::VectorXd new_col_;
+	Eigen::RowVectorXd v_row_;
+	Eigen::VectorXd u_col_;
+	Eigen::VectorXd work_col_;
+	Eigen::RowVectorXd work_row_;
+
+	// Factorisation used for direct inversions, kept so re-anchoring reuses its storage
+	Eigen::PartialPivLU<Eigen::MatrixXd> lu_;
+
+	// Condition tracking, see track_condition. col_norms_ holds the absolute
+	// column sums of the combination, so |A|_1 is its largest entry; it is
+	// only maintained while tracking.
+	double reanchor_rcond_ = -1;
+	Eigen::RowVectorXd col_norms_;
+	double inverse_norm_ = 0;
+	int64_t reanchors_ = 0;
+
+	// Singular-swap handling, see step. Smallest |1 + v A^-1 u| accepted for a
+	// rank-1 update, the state of the current combination, and what was needed.
+	double singular_tolerance_ = std::sqrt(std::numeric_limits<double>::epsilon());
+	bool singular_ = false;
+	sherman_fallbacks_t fallbacks_;
+
+	// Copies of the pivot row/column and a second update row for the rank-2 form
+	Eigen::VectorXd pivot_col_;
+	Eigen::RowVectorXd pivot_row_;
+	Eigen::RowVectorXd fused_row_;
+
+public:
+	// step() works entirely in preallocated storage
+	static const bool allocates_in_step = false;
+
+	basic_sherman_engine_t(const Main& main, const schedule_t& schedule)
+		:
+	main_(main),
+	schedule_(schedule)
+	{
+	}
+
+	// Compute the inverse of combination rank directly
+	void seed(int64_t rank)
+	{
+		restore(rank, Eigen::MatrixXd());
+	}
+
+	// Resume at combination rank with a previously computed inverse, e.g. from a
+	// checkpoint, so that later steps match an uninterrupted run exactly unless
+	// condition tracking is on, whose norms are recomputed here rather than
+	// restored. An empty inverse is computed directly instead.
+	void restore(int64_t rank, const Eigen::MatrixXd& inverse)
+	{
+		rank_ = rank;
+		comb_to_main_ = schedule_.selection_at(rank);
+		auto n = comb_size();
+		new_row_.resize(n);
+		new_col_.resize(n);
+		v_row_.resize(n);
+		u_col_.resize(n);
+		work_col_.resize(n);
+		work_row_.resize(n);
+		pivot_col_.resize(n);
+		pivot_row_.resize(n);
+		fused_row_.resize(n);
+
+		// A checkpoint taken at a singular combination holds no usable inverse
+		if (inverse.size() && inverse.allFinite())
+		{
+			inverse_ = inverse;
+			singular_ = false;
+			refresh_norms();
+		}
+		else
+		{
+			invert_directly();
+		}
+	}
+
+	// Advance to the next combination by applying the next swap of the schedule
+	void step()
+	{
+		const swap_t* swap;
+		{
+			PHASE_SCOPE(phase_gray);
+			swap = &schedule_[rank_];
+			++rank_;
+		}
+		{
+			PHASE_SCOPE(phase_mapping);
+			comb_to_main_[swap->slot] = swap->added;
+		}
+
+		// Replacement row and column, and their changes
+		{
+			PHASE_SCOPE(phase_gather);
+			gather_swap(main_, *swap, comb_to_main_, new_row_, new_col_, v_row_, u_col_);
+		}
+		update(swap->slot, swap->removed, new_row_, new_col_, v_row_, u_col_);
+	}
+
+	// Advance to the next combination with operands gathered ahead of time,
+	// which must be those of the next swap of the schedule. They are read in
+	// place, so gathered must stay valid until this returns.
+	void step(const gathered_swap_t& gathered)
+	{
+		const auto& swap = gathered.swap;
+		++rank_;
+		comb_to_main_[swap.slot] = swap.added;
+		update(swap.slot, swap.removed, gathered.new_row, gathered.new_col, gathered.v_row, gathered.u_col);
+	}
+
+	// Smallest |1 + v A^-1 u|, the ratio of determinants across a rank-1 update,
+	// for which the update is applied rather than avoided. The default of
+	// sqrt(epsilon) bounds the error amplification of an update at about 1e8.
+	void set_singular_tolerance(double tolerance)
+	{
+		singular_tolerance_ = tolerance;
+	}
+
+	// True if the current combination is singular, in which case inverse() is NaN
+	bool singular() const
+	{
+		return singular_;
+	}
+
+	const sherman_fallbacks_t& fallbacks() const
+	{
+		return fallbacks_;
+	}
+
+	// Keep |A|_1 and |A^-1|_1 up to date on every step so rcond() is O(1), and
+	// re-anchor whenever it falls below reanchor_below, since updates applied to
+	// an ill-conditioned inverse lose accuracy. The 1-norm of the inverse is taken
+	// exactly from the explicit inverse in the same pass as the column update,
+	// which costs less than a Hager-Higham estimate needing solves with A.
+	void track_condition(double reanchor_below = 0)
+	{
+		reanchor_rcond_ = reanchor_below;
+	}
+
+	bool tracking_condition() const
+	{
+		return reanchor_rcond_ >= 0;
+	}
+
+	// Reciprocal 1-norm condition number of the current combination. Without
+	// tracking both norms are summed on each call, in O(k^2), as col_norms_ is
+	// only kept up to date while tracking.
+	double rcond() const
+	{
+		auto inverse_norm = tracking_condition() ? inverse_norm_ : inverse_.cwiseAbs().colwise().sum().maxCoeff();
+		auto norm = tracking_condition() ? col_norms_.maxCoeff() : indexed_view(main_, comb_to_main_, comb_to_main_).cwiseAbs().colwise().sum().maxCoeff();
+		return norm > 0 && inverse_norm > 0 ? 1 / (norm * inverse_norm) : 0;
+	}
+
+	// Recompute the inverse of the current combination directly, discarding the
+	// rounding errors accumulated by the updates. Does not allocate.
+	void reanchor()
+	{
+		invert_directly();
+		++reanchors_;
+	}
+
+	// Number of re-anchors since construction
+	int64_t reanchors() const
+	{
+		return reanchors_;
+	}
+
+	// Rank of the current combination in the schedule
+	int64_t rank() const
+	{
+		return rank_;
+	}
+
+	int comb_size() const
+	{
+		return schedule_.comb_size();
+	}
+
+	const std::vector<int>& comb_to_main() const
+	{
+		return comb_to_main_;
+	}
+
+	const Eigen::MatrixXd& inverse() const
+	{
+		return inverse_;
+	}
+
+private:
+	// Apply the swap of removed at slot with the operands of gather_swap, either
+	// the engine's own or gathered ahead of time
+	void update(int slot, int removed, const Eigen::RowVectorXd& new_row, const Eigen::VectorXd& new_col, const Eigen::RowVectorXd& v_row, const Eigen::VectorXd& u_col)
+	{
+		// After a singular combination there is no inverse to update
+		if (singular_)
+		{
+			fallback_direct();
+			return;
+		}
+
+		// Update the inverse for the row replacement, unless that would pass
+		// through a near singular matrix
+		{
+			PHASE_SCOPE(phase_row_update);
+			if (!(std::abs(1 + v_row.dot(inverse_.col(slot))) >= singular_tolerance_))
+			{
+				near_singular_swap(slot, removed, new_row, new_col, v_row);
+				return;
+			}
+			if (tracking_condition())
+			{
+				col_norms_ += new_row.cwiseAbs() - (new_row - v_row).cwiseAbs();
+			}
+			sherman_morrison_update_row(inverse_, slot, v_row, work_col_, work_row_);
+		}
+
+		// And for the column replacement. With a regular intermediate matrix a
+		// near zero denominator means the new combination itself is near singular.
+		{
+			PHASE_SCOPE(phase_col_update);
+			if (!(std::abs(1 + inverse_.row(slot).dot(u_col)) >= singular_tolerance_))
+			{
+				fallback_direct();
+				return;
+			}
+			if (!tracking_condition())
+			{
+				sherman_morrison_update_col(inverse_, slot, u_col, work_col_, work_row_);
+				return;
+			}
+			col_norms_[slot] = new_col.lpNorm<1>();
+			inverse_norm_ = sherman_morrison_update_col_norm(inverse_, slot, u_col, work_col_, work_row_);
+		}
+		if (rcond() < reanchor_rcond_)
+		{
+			reanchor();
+		}
+	}
+
+	// Invert the current combination directly, marking it singular if a pivot of
+	// its LU factorisation vanishes relative to the largest
+	void invert_directly()
+	{
+		lu_.compute(indexed_view(main_, comb_to_main_, comb_to_main_));
+		inverse_.resize(comb_size(), comb_size());
+		singular_ = !lu_inverse(lu_, inverse_);
+		if (singular_)
+		{
+			++fallbacks_.singular;
+		}
+		refresh_norms();
+	}
+
+	// Leave the update path for a direct inversion
+	void fallback_direct()
+	{
+		++fallbacks_.direct;
+		invert_directly();
+	}
+
+	void refresh_norms()
+	{
+		col_norms_ = indexed_view(main_, comb_to_main_, comb_to_main_).cwiseAbs().colwise().sum();
+		inverse_norm_ = inverse_.cwiseAbs().colwise().sum().maxCoeff();
+	}
+
+	// Replacing the row first would pass through a near singular matrix. v_row
+	// holds the row change and the inverse is unchanged. Try the column first,
+	// then both at once as a rank-2 Woodbury update, and otherwise invert the
+	// new combination directly. The reordered operands go to u_col_ and v_row_,
+	// which v_row may alias, so it is only read before v_row_ is written.
+	void near_singular_swap(int slot, int removed, const Eigen::RowVectorXd& new_row, const Eigen::VectorXd& new_col, const Eigen::RowVectorXd& v_row)
+	{
+		u_col_ = new_col - indexed_view(main_, replaced_index(comb_to_main_, slot, removed), single_index_t{ removed });
+		if (std::abs(1 + inverse_.row(slot).dot(u_col_)) >= singular_tolerance_)
+		{
+			sherman_morrison_update_col(inverse_, slot, u_col_, work_col_, work_row_);
+			v_row_ = new_row - indexed_view(main_, single_index_t{ removed }, comb_to_main_);
+			v_row_[slot] = new_row[slot] - new_col[slot];
+			if (std::abs(1 + v_row_.dot(inverse_.col(slot))) >= singular_tolerance_)
+			{
+				++fallbacks_.reordered;
+				sherman_morrison_update_row(inverse_, slot, v_row_, work_col_, work_row_);
+				refresh_norms();
+			}
+			else
+			{
+				fallback_direct();
+			}
+			return;
+		}
+
+		// A + e_s v + u e_s^T with u the column change after the row replacement,
+		// inverted through the 2 x 2 capacitance matrix S = I + [v; e_s^T] A^-1 [e_s u]
+		u_col_[slot] = new_col[slot] - new_row[slot];
+		work_col_.noalias() = inverse_ * u_col_;
+		work_row_.noalias() = v_row * inverse_;
+		auto s00 = 1 + work_row_[slot];
+		auto s01 = work_row_.dot(u_col_);
+		auto s10 = inverse_(slot, slot);
+		auto s11 = 1 + work_col_[slot];
+		auto det = s00 * s11 - s01 * s10;
+		if (!(std::abs(det) >= singular_tolerance_))
+		{
+			fallback_direct();
+			return;
+		}
+
+		// A^-1 - [A^-1 e_s, A^-1 u] S^-1 [v A^-1; e_s^T A^-1]
+		++fallbacks_.fused;
+		pivot_col_ = inverse_.col(slot);
+		pivot_row_ = inverse_.row(slot);
+		fused_row_ = (s11 * work_row_ - s01 * pivot_row_) / det;
+		pivot_row_ = (s00 * pivot_row_ - s10 * work_row_) / det;
+		inverse_.noalias() -= pivot_col_ * fused_row_;
+		inverse_.noalias() -= work_col_ * pivot_row_;
+		refresh_norms();
+	}
+};
+
+typedef basic_sherman_engine_t<main_matrix_t> sherman_engine_t;
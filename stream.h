@@ -0,0 +1,183 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "eigen/Dense"
+
+#include "matrix.h"
+#include "schedule.h"
+#include "sherman.h"
+
+// Walks a schedule on a producer thread, gathering the operands of every swap
+// from the main matrix into a bounded single-producer single-consumer ring. The
+// consumer takes them ready to use, so for main matrices too large for cache the
+// gathers' misses overlap with the update arithmetic of earlier steps instead of
+// stalling it. Once constructed neither side allocates or locks; a side that
+// finds the ring full or empty yields until the other catches up.
+class gather_stream_t
+{
+	main_matrix_t main_;
+	const schedule_t& schedule_;
+	int64_t end_;
+
+	// Slot n % capacity holds the operands of swap begin + n. produced_ and
+	// consumed_ count swaps and each is written by one side only, on separate
+	// cache lines so the two threads do not share one.
+	std::vector<gathered_swap_t> ring_;
+	alignas(64) std::atomic<int64_t> produced_{0};
+	alignas(64) std::atomic<int64_t> consumed_{0};
+	alignas(64) std::atomic<bool> stop_{false};
+
+	// Producer state: the selection after the last gathered swap
+	int64_t next_;
+	std::vector<int> comb_to_main_;
+	std::thread producer_;
+
+	void produce()
+	{
+		const auto capacity = static_cast<int64_t>(ring_.size());
+		for (int64_t n = 0; next_ < end_; ++n, ++next_)
+		{
+			while (n - consumed_.load(std::memory_order_acquire) >= capacity)
+			{
+				if (stop_.load(std::memory_order_relaxed))
+				{
+					return;
+				}
+				std::this_thread::yield();
+			}
+			if (stop_.load(std::memory_order_relaxed))
+			{
+				return;
+			}
+			auto& gathered = ring_[n % capacity];
+			gathered.swap = schedule_[next_];
+			comb_to_main_[gathered.swap.slot] = gathered.swap.added;
+			gather_swap(main_, gathered.swap, comb_to_main_, gathered.new_row, gathered.new_col, gathered.v_row, gathered.u_col);
+			produced_.store(n + 1, std::memory_order_release);
+		}
+	}
+
+public:
+	// Stream the swaps leading from combination begin up to end
+	gather_stream_t(const main_matrix_t& main, const schedule_t& schedule, int64_t begin, int64_t end, int capacity = 64)
+		:
+	main_(main),
+	schedule_(schedule),
+	end_(end - 1),
+	ring_(capacity),
+	next_(begin),
+	comb_to_main_(schedule.selection_at(begin))
+	{
+		auto n = schedule.comb_size();
+		for (auto& gathered : ring_)
+		{
+			gathered.new_row.resize(n);
+			gathered.new_col.resize(n);
+			gathered.v_row.resize(n);
+			gathered.u_col.resize(n);
+		}
+		producer_ = std::thread([this]() { produce(); });
+	}
+
+	gather_stream_t(const gather_stream_t&) = delete;
+	gather_stream_t& operator=(const gather_stream_t&) = delete;
+
+	~gather_stream_t()
+	{
+		stop_.store(true, std::memory_order_relaxed);
+		producer_.join();
+	}
+
+	// Operands of the next swap, waiting for the producer if need be. There
+	// must be one left.
+	const gathered_swap_t& front() const
+	{
+		auto n = consumed_.load(std::memory_order_relaxed);
+		while (produced_.load(std::memory_order_acquire) <= n)
+		{
+			std::this_thread::yield();
+		}
+		return ring_[n % ring_.size()];
+	}
+
+	// Release the slot returned by front to the producer
+	void pop()
+	{
+		consumed_.store(consumed_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+};
+
+// sherman_engine_t taking its operands from a gather_stream_t, so each step is
+// only the update arithmetic, reading them in place from the ring. A stream is
+// started at every seed and runs ahead to the end given there, or of the
+// schedule. This costs a second thread per engine and only pays off when the
+// gathers miss cache: for a main matrix that fits in L1 the hand-off costs more
+// than the gather it saves.
+class streamed_sherman_engine_t
+{
+	main_matrix_t main_;
+	const schedule_t& schedule_;
+	sherman_engine_t engine_;
+	std::unique_ptr<gather_stream_t> stream_;
+	int capacity_;
+
+public:
+	static const bool allocates_in_step = false;
+
+	streamed_sherman_engine_t(const main_matrix_t& main, const schedule_t& schedule, int capacity = 64)
+		:
+	main_(main),
+	schedule_(schedule),
+	engine_(main, schedule),
+	capacity_(capacity)
+	{
+	}
+
+	void seed(int64_t rank)
+	{
+		seed(rank, schedule_.combinations());
+	}
+
+	// Seed at rank for stepping up to combination end, so the producer stops
+	// there rather than gathering swaps nobody will take
+	void seed(int64_t rank, int64_t end)
+	{
+		stream_.reset();
+		engine_.seed(rank);
+		stream_.reset(new gather_stream_t(main_, schedule_, rank, end, capacity_));
+	}
+
+	void step()
+	{
+		engine_.step(stream_->front());
+		stream_->pop();
+	}
+
+	// The underlying engine, for condition tracking and singular handling
+	sherman_engine_t& engine()
+	{
+		return engine_;
+	}
+
+	int64_t rank() const
+	{
+		return engine_.rank();
+	}
+
+	int comb_size() const
+	{
+		return engine_.comb_size();
+	}
+
+	const std::vector<int>& comb_to_main() const
+	{
+		return engine_.comb_to_main();
+	}
+
+	const Eigen::MatrixXd& inverse() const
+	{
+		return engine_.inverse();
+	}
+};
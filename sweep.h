@@ -0,0 +1,260 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "eigen/Dense"
+
+#include "block.h"
+#include "delayed.h"
+#include "direct.h"
+#include "enumerate.h"
+#include "lockstep.h"
+#include "schedule.h"
+#include "sherman.h"
+
+// Grid of problem shapes and thread counts for a scaling sweep. Every layout is
+// built from copies of one group shape, as many as needed to reach comb_size items
+// per combination. Only the first combinations of each layout are enumerated.
+struct sweep_options_t
+{
+	std::vector<group_t> group_shapes = { {4, 2}, {8, 4}, {16, 8} };
+	std::vector<int> comb_sizes = { 8, 16, 32, 64, 128, 256 };
+	std::vector<int> threads;
+	int64_t combinations = 256;
+	int repetitions = 3;
+	bool json = false;
+};
+
+// An engine that can enumerate any schedule with a given number of threads,
+// returning the number of combinations it inverted.
+struct sweep_engine_t
+{
+	const char* name;
+	std::function<int64_t(const Eigen::MatrixXd&, const schedule_t&, int)> run;
+};
+
+// Run Engine through enumerate_openmp, touching every inverse so none is optimised away
+template<class Engine>
+int64_t sweep_enumerate(const Eigen::MatrixXd& main, const schedule_t& schedule, int threads)
+{
+	std::vector<double> sink(enumerate_threads(threads));
+	enumerate_openmp<Engine>(main, schedule, threads, [&](int thread, const Engine& engine)
+	{
+		sink[thread] += engine.inverse()(0, 0);
+	});
+	return schedule.combinations();
+}
+
+// As sweep_enumerate, reading the inverse through the factored form, which is
+// what the delayed engine is for
+inline int64_t sweep_delayed(const Eigen::MatrixXd& main, const schedule_t& schedule, int threads)
+{
+	std::vector<double> sink(enumerate_threads(threads));
+	enumerate_openmp<delayed_sherman_engine_t>(main, schedule, threads, [&](int thread, const delayed_sherman_engine_t& engine)
+	{
+		sink[thread] += engine.factored().coeff(0, 0);
+	});
+	return schedule.combinations();
+}
+
+// Every thread runs its own lock-step batch of Lanes copies of main
+template<int Lanes>
+int64_t sweep_lockstep(const Eigen::MatrixXd& main, const schedule_t& schedule, int threads)
+{
+	threads = enumerate_threads(threads);
+	std::array<Eigen::MatrixXd, Lanes> mains;
+	mains.fill(main);
+	#pragma omp parallel num_threads(threads)
+	{
+		lockstep_sherman_t<Lanes> lockstep(schedule, mains);
+		lockstep.run();
+	}
+	return schedule.combinations() * Lanes * threads;
+}
+
+inline std::vector<sweep_engine_t> sweep_engines()
+{
+	return {
+		{"direct", sweep_enumerate<direct_engine_t>},
+		{"sherman", sweep_enumerate<sherman_engine_t>},
+		{"delayed", sweep_delayed},
+		{"block", sweep_enumerate<block_engine_t>},
+		{"lockstep8", sweep_lockstep<8>},
+	};
+}
+
+// Parse a comma separated list of values with parse_value
+template<class T, class Parse>
+std::vector<T> parse_sweep_list(const std::string& text, Parse parse_value)
+{
+	std::vector<T> values;
+	std::stringstream stream(text);
+	std::string item;
+	while (std::getline(stream, item, ','))
+	{
+		values.push_back(parse_value(item));
+	}
+	return values;
+}
+
+// Read sweep options from the command line:
+//   --format csv|json  --threads 1,2,4  --comb-sizes 8,16  --groups 4:2,8:4
+//   --combinations N  --repetitions R
+inline sweep_options_t parse_sweep_options(int argc, char* argv[])
+{
+	sweep_options_t options;
+	auto to_int = [](const std::string& s) { return std::stoi(s); };
+	for (int i = 1; i + 1 < argc; ++i)
+	{
+		std::string name = argv[i];
+		std::string value = argv[i + 1];
+		if (name == "--format")
+		{
+			options.json = value == "json";
+		}
+		else if (name == "--threads")
+		{
+			options.threads = parse_sweep_list<int>(value, to_int);
+		}
+		else if (name == "--comb-sizes")
+		{
+			options.comb_sizes = parse_sweep_list<int>(value, to_int);
+		}
+		else if (name == "--groups")
+		{
+			options.group_shapes = parse_sweep_list<group_t>(value, [](const std::string& s)
+			{
+				auto colon = s.find(':');
+				return group_t{ std::stoi(s.substr(0, colon)), std::stoi(s.substr(colon + 1)) };
+			});
+		}
+		else if (name == "--combinations")
+		{
+			options.combinations = std::stoll(value);
+		}
+		else if (name == "--repetitions")
+		{
+			options.repetitions = std::stoi(value);
+		}
+		else
+		{
+			continue;
+		}
+		++i;
+	}
+	if (options.threads.empty())
+	{
+		for (int threads = 1; threads < omp_get_max_threads(); threads *= 2)
+		{
+			options.threads.push_back(threads);
+		}
+		options.threads.push_back(omp_get_max_threads());
+	}
+	return options;
+}
+
+// One measured point of the sweep
+struct sweep_result_t
+{
+	std::string engine;
+	group_t group;
+	int groups;
+	int comb_size;
+	int threads;
+	int64_t combinations;
+	double ns_per_combination;
+	double speedup;
+	double efficiency;
+};
+
+inline void write_sweep_result(std::ostream& out, const sweep_result_t& r, bool json, bool first)
+{
+	if (json)
+	{
+		out << (first ? "[\n" : ",\n");
+		out << "  {\"engine\": \"" << r.engine << "\", \"group_size\": " << r.group.size
+			<< ", \"pick\": " << r.group.pick << ", \"groups\": " << r.groups
+			<< ", \"comb_size\": " << r.comb_size << ", \"threads\": " << r.threads
+			<< ", \"combinations\": " << r.combinations
+			<< ", \"ns_per_combination\": " << r.ns_per_combination
+			<< ", \"speedup\": " << r.speedup << ", \"efficiency\": " << r.efficiency << "}";
+	}
+	else
+	{
+		if (first)
+		{
+			out << "engine,group_size,pick,groups,comb_size,threads,combinations,ns_per_combination,speedup,efficiency\n";
+		}
+		out << r.engine << "," << r.group.size << "," << r.group.pick << "," << r.groups << ","
+			<< r.comb_size << "," << r.threads << "," << r.combinations << ","
+			<< r.ns_per_combination << "," << r.speedup << "," << r.efficiency << "\n";
+	}
+	out.flush();
+}
+
+// Time every engine over the grid, writing one CSV row or JSON object per point.
+// Times are the median over repetitions. Speedup is relative to the same engine
+// and shape on one thread, and efficiency is speedup divided by threads.
+inline int run_sweep(const sweep_options_t& options, std::ostream& out)
+{
+	auto first = true;
+	for (const auto& group : options.group_shapes)
+	{
+		for (auto comb_size : options.comb_sizes)
+		{
+			if (!valid_group(group) || comb_size % group.pick != 0)
+			{
+				continue;
+			}
+			std::vector<group_t> groups(comb_size / group.pick, group);
+			auto schedule = make_schedule(groups, options.combinations);
+
+			// Diagonally dominant so that long update chains stay well conditioned
+			auto size = schedule->size();
+			Eigen::MatrixXd main = Eigen::MatrixXd::Random(size, size);
+			main.diagonal().array() += size;
+
+			for (const auto& engine : sweep_engines())
+			{
+				auto single = 0.0;
+				auto threads_list = options.threads;
+				threads_list.erase(std::remove(threads_list.begin(), threads_list.end(), 1), threads_list.end());
+				threads_list.insert(threads_list.begin(), 1);
+				for (auto threads : threads_list)
+				{
+					std::vector<double> samples;
+					int64_t combinations = 0;
+					for (int rep = 0; rep < std::max(1, options.repetitions); ++rep)
+					{
+						auto start = std::chrono::steady_clock::now();
+						combinations = engine.run(main, *schedule, threads);
+						std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+						samples.push_back(elapsed.count() / combinations);
+					}
+					std::sort(samples.begin(), samples.end());
+					auto ns = samples[samples.size() / 2];
+					if (threads == 1)
+					{
+						single = ns;
+					}
+
+					// Throughput based speedup, since parallel runs may do more work in total
+					auto speedup = single / ns;
+					sweep_result_t result = { engine.name, group, static_cast<int>(groups.size()), comb_size, threads,
+						combinations, ns, speedup, speedup / threads };
+					write_sweep_result(out, result, options.json, first);
+					first = false;
+				}
+			}
+		}
+	}
+	if (options.json)
+	{
+		out << (first ? "[" : "") << "\n]\n";
+	}
+	return 0;
+}
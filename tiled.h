@@ -0,0 +1,413 @@
+#pragma once
+#ifdef __linux__
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "eigen/Core"
+
+#include "matrix.h"
+#include "schedule.h"
+#include "sherman.h"
+
+// Out-of-core main matrices. The matrix lives in a file of square tiles that is
+// memory mapped read-only, so only the pages holding tiles that combinations
+// actually touch are ever read, and the kernel can drop them again under memory
+// pressure. A swap reads one row and one column of the main matrix restricted to
+// the selected items, i.e. one tile per selected item for each, so tiles rather
+// than whole rows or columns keep the pages read proportional to the selection.
+//
+// File layout: a tiled_header_t padded to tiled_data_offset, then the tiles in
+// column-major order of tiles, each tile x tile entries column-major. Edge tiles
+// are padded to full size.
+
+const uint64_t tiled_data_offset = 4096;
+
+// Largest tile and row or column count a header may give
+const uint64_t tiled_max_tile = uint64_t(1) << 12;
+const uint64_t tiled_max_rows = uint64_t(1) << 31;
+
+struct tiled_header_t
+{
+	char magic[8];
+	uint64_t rows;
+	uint64_t cols;
+	uint64_t tile;
+};
+
+inline const char* tiled_magic()
+{
+	return "INVTILE1";
+}
+
+// Reads a tiled file mapping as a matrix, for basic_sherman_engine_t and the
+// gathers in matrix.h. A cheap copyable view; the tiled_file_t must outlive it.
+class tiled_view_t
+{
+	const double* data_;
+	int64_t tile_rows_;
+	int shift_;
+	int64_t mask_;
+	int64_t rows_;
+	int64_t cols_;
+
+public:
+	tiled_view_t(const double* data, int64_t rows, int64_t cols, int shift)
+		:
+	data_(data),
+	tile_rows_(((rows - 1) >> shift) + 1),
+	shift_(shift),
+	mask_((int64_t(1) << shift) - 1),
+	rows_(rows),
+	cols_(cols)
+	{
+	}
+
+	// Offset of entry (r, c) from the first tile, in entries
+	int64_t offset(int64_t r, int64_t c) const
+	{
+		auto tile = (c >> shift_) * tile_rows_ + (r >> shift_);
+		return (tile << (2 * shift_)) + ((c & mask_) << shift_) + (r & mask_);
+	}
+
+	double operator()(int64_t r, int64_t c) const
+	{
+		return data_[offset(r, c)];
+	}
+
+	int64_t rows() const
+	{
+		return rows_;
+	}
+
+	int64_t cols() const
+	{
+		return cols_;
+	}
+};
+
+// A tiled main matrix file, mapped read-only
+class tiled_file_t
+{
+	std::string path_;
+	void* data_ = MAP_FAILED;
+	size_t size_ = 0;
+	tiled_header_t header_;
+	int shift_ = 0;
+	long page_ = sysconf(_SC_PAGESIZE);
+
+public:
+	explicit tiled_file_t(const std::string& path)
+		:
+	path_(path)
+	{
+		auto fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+		{
+			throw std::runtime_error("cannot open tiled matrix " + path);
+		}
+		struct stat status;
+		if (fstat(fd, &status) != 0 || pread(fd, &header_, sizeof(header_), 0) != static_cast<ssize_t>(sizeof(header_)) || std::memcmp(header_.magic, tiled_magic(), 8) != 0)
+		{
+			close(fd);
+			throw std::runtime_error("not a tiled matrix " + path);
+		}
+		// Bound the header before deriving anything from it, so that a corrupt one
+		// can neither shift past 63 bits nor overflow data_bytes
+		if (header_.tile == 0 || header_.tile > tiled_max_tile || header_.rows > tiled_max_rows || header_.cols > tiled_max_rows)
+		{
+			close(fd);
+			throw std::runtime_error("corrupt tiled matrix header in " + path);
+		}
+		while ((uint64_t(1) << shift_) < header_.tile)
+		{
+			++shift_;
+		}
+		size_ = static_cast<size_t>(status.st_size);
+		if (header_.rows == 0 || header_.cols == 0 || (uint64_t(1) << shift_) != header_.tile || size_ < tiled_data_offset + data_bytes(header_.rows, header_.cols, header_.tile))
+		{
+			close(fd);
+			throw std::runtime_error("truncated tiled matrix " + path);
+		}
+		data_ = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (data_ == MAP_FAILED)
+		{
+			throw std::runtime_error("cannot map tiled matrix " + path);
+		}
+
+		// Combinations touch scattered tiles, so readahead around a fault would
+		// mostly read pages that are not needed; prefetch asks for the right ones
+		madvise(data_, size_, MADV_RANDOM);
+	}
+
+	tiled_file_t(const tiled_file_t&) = delete;
+	tiled_file_t& operator=(const tiled_file_t&) = delete;
+
+	~tiled_file_t()
+	{
+		if (data_ != MAP_FAILED)
+		{
+			munmap(data_, size_);
+		}
+	}
+
+	tiled_view_t view() const
+	{
+		return tiled_view_t(tiles(), header_.rows, header_.cols, shift_);
+	}
+
+	int64_t rows() const
+	{
+		return header_.rows;
+	}
+
+	int64_t cols() const
+	{
+		return header_.cols;
+	}
+
+	// Number of tiles, and the tile holding entry (r, c)
+	int64_t tile_count() const
+	{
+		return static_cast<int64_t>(data_bytes(header_.rows, header_.cols, header_.tile) / sizeof(double)) >> (2 * shift_);
+	}
+
+	int64_t tile_of(int64_t r, int64_t c) const
+	{
+		return view().offset(r, c) >> (2 * shift_);
+	}
+
+	// Ask the kernel to start reading a tile. Does not wait for the read.
+	void prefetch(int64_t tile) const
+	{
+		auto begin = reinterpret_cast<uintptr_t>(tiles() + (tile << (2 * shift_)));
+		auto end = reinterpret_cast<uintptr_t>(tiles() + ((tile + 1) << (2 * shift_)));
+		begin &= ~static_cast<uintptr_t>(page_ - 1);
+		madvise(reinterpret_cast<void*>(begin), end - begin, MADV_WILLNEED);
+	}
+
+	// Bytes of tile data for a rows x cols matrix in tiles of tile x tile
+	static uint64_t data_bytes(uint64_t rows, uint64_t cols, uint64_t tile)
+	{
+		return ((rows + tile - 1) / tile) * ((cols + tile - 1) / tile) * tile * tile * sizeof(double);
+	}
+
+	// Write a rows x cols matrix with entries f(r, c) as a tiled file, one tile at
+	// a time, so the matrix never has to fit in memory. tile must be a power of two.
+	template<class F>
+	static void write(const std::string& path, int64_t rows, int64_t cols, int64_t tile, F&& f)
+	{
+		if (rows <= 0 || cols <= 0 || tile <= 0 || (tile & (tile - 1)) != 0 || static_cast<uint64_t>(tile) > tiled_max_tile || static_cast<uint64_t>(std::max(rows, cols)) > tiled_max_rows)
+		{
+			throw std::invalid_argument("tiled_file_t: bad dimensions for " + path);
+		}
+		std::ofstream out(path, std::ios::binary);
+		tiled_header_t header = {};
+		std::memcpy(header.magic, tiled_magic(), 8);
+		header.rows = rows;
+		header.cols = cols;
+		header.tile = tile;
+		std::vector<char> page(tiled_data_offset);
+		std::memcpy(page.data(), &header, sizeof(header));
+		out.write(page.data(), page.size());
+
+		std::vector<double> entries(tile * tile);
+		for (int64_t tc = 0; tc < cols; tc += tile)
+		{
+			for (int64_t tr = 0; tr < rows; tr += tile)
+			{
+				for (int64_t c = 0; c < tile; ++c)
+				{
+					for (int64_t r = 0; r < tile; ++r)
+					{
+						entries[c * tile + r] = tr + r < rows && tc + c < cols ? f(tr + r, tc + c) : 0.0;
+					}
+				}
+				out.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(double));
+			}
+		}
+		if (!out)
+		{
+			throw std::runtime_error("cannot write tiled matrix " + path);
+		}
+	}
+
+	static void write(const std::string& path, const main_matrix_t& m, int64_t tile = 32)
+	{
+		write(path, m.rows(), m.cols(), tile, [&](int64_t r, int64_t c) { return m(r, c); });
+	}
+
+private:
+	const double* tiles() const
+	{
+		return reinterpret_cast<const double*>(static_cast<const char*>(data_) + tiled_data_offset);
+	}
+};
+
+// Page faults and bytes read from storage by this process, for judging how much
+// of an out-of-core run waited on I/O. Major faults are the ones that had to
+// read. read_bytes comes from /proc/self/io and is -1 where that is unavailable.
+struct io_stats_t
+{
+	int64_t minor_faults;
+	int64_t major_faults;
+	int64_t read_bytes;
+};
+
+inline io_stats_t operator-(const io_stats_t& a, const io_stats_t& b)
+{
+	return { a.minor_faults - b.minor_faults, a.major_faults - b.major_faults, a.read_bytes < 0 || b.read_bytes < 0 ? -1 : a.read_bytes - b.read_bytes };
+}
+
+inline io_stats_t io_stats()
+{
+	io_stats_t stats = { 0, 0, -1 };
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0)
+	{
+		stats.minor_faults = usage.ru_minflt;
+		stats.major_faults = usage.ru_majflt;
+	}
+	std::ifstream in("/proc/self/io");
+	std::string key;
+	int64_t value;
+	while (in >> key >> value)
+	{
+		if (key == "read_bytes:")
+		{
+			stats.read_bytes = value;
+		}
+	}
+	return stats;
+}
+
+// sherman_engine_t over a tiled file, prefetching the tiles of the swaps
+// distance steps ahead of the current one, which the schedule already knows.
+// Page faults on tiles that are not resident yet still block the step, but with
+// enough distance the reads have finished by the time the step gets there.
+// A madvise call costs more than a step, so a tile is advised at most once per
+// window of swaps: one needed again within the window was touched recently and
+// is most likely still resident, while one needed after it may have been dropped
+// under memory pressure and is advised again, so later passes over a main that
+// does not fit in memory are prefetched too. A distance of zero turns
+// prefetching off.
+class tiled_sherman_engine_t
+{
+	const tiled_file_t& file_;
+	const schedule_t& schedule_;
+	basic_sherman_engine_t<tiled_view_t> engine_;
+
+	// Selection after the last prefetched swap and its rank. advised_[tile] is one
+	// more than the window the tile was last advised in, zero if never.
+	int distance_;
+	int64_t window_;
+	int64_t ahead_ = 0;
+	std::vector<int> ahead_to_main_;
+	std::vector<uint32_t> advised_;
+
+	void prefetch(int64_t tile)
+	{
+		auto window = static_cast<uint32_t>(ahead_ / window_ + 1);
+		if (advised_[tile] != window)
+		{
+			advised_[tile] = window;
+			file_.prefetch(tile);
+		}
+	}
+
+	// Prefetch the tiles of the row and column gathers of every swap up to rank
+	void prefetch_to(int64_t rank)
+	{
+		rank = std::min(rank, schedule_.combinations() - 1);
+		for (; ahead_ < rank; ++ahead_)
+		{
+			const auto& swap = schedule_[ahead_];
+			ahead_to_main_[swap.slot] = swap.added;
+			for (auto item : ahead_to_main_)
+			{
+				prefetch(file_.tile_of(swap.added, item));
+				prefetch(file_.tile_of(item, swap.added));
+			}
+		}
+	}
+
+public:
+	static const bool allocates_in_step = false;
+
+	// Prefetch distance swaps ahead, advising each tile at most once per window
+	// swaps, which must be positive
+	tiled_sherman_engine_t(const tiled_file_t& file, const schedule_t& schedule, int distance = 16, int64_t window = 4096)
+		:
+	file_(file),
+	schedule_(schedule),
+	engine_(file.view(), schedule),
+	distance_(distance),
+	window_(window),
+	advised_(distance > 0 ? file.tile_count() : 0, 0)
+	{
+		if (file.rows() != schedule.size() || file.cols() != schedule.size())
+		{
+			throw std::invalid_argument("tiled_sherman_engine_t: matrix and schedule sizes differ");
+		}
+		if (window < 1)
+		{
+			throw std::invalid_argument("tiled_sherman_engine_t: window must be positive");
+		}
+	}
+
+	void seed(int64_t rank)
+	{
+		ahead_ = rank;
+		ahead_to_main_ = schedule_.selection_at(rank);
+		if (distance_ > 0)
+		{
+			prefetch_to(rank + distance_);
+		}
+		engine_.seed(rank);
+	}
+
+	void step()
+	{
+		if (distance_ > 0)
+		{
+			prefetch_to(engine_.rank() + 1 + distance_);
+		}
+		engine_.step();
+	}
+
+	// The underlying engine, for condition tracking and singular handling
+	basic_sherman_engine_t<tiled_view_t>& engine()
+	{
+		return engine_;
+	}
+
+	int64_t rank() const
+	{
+		return engine_.rank();
+	}
+
+	int comb_size() const
+	{
+		return engine_.comb_size();
+	}
+
+	const std::vector<int>& comb_to_main() const
+	{
+		return engine_.comb_to_main();
+	}
+
+	const Eigen::MatrixXd& inverse() const
+	{
+		return engine_.inverse();
+	}
+};
+#endif
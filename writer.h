@@ -0,0 +1,404 @@
+#pragma once
+#ifdef __linux__
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Streaming results out of the enumeration without blocking the workers on I/O
+// or on a shared lock. Each worker fills fixed-size buffers through its own
+// result_sink_t and hands full ones to a writer thread over a bounded lock-free
+// queue; the writer drains them to a file descriptor (a file, pipe or socket)
+// and returns them to a free queue for reuse. Nothing is allocated per result,
+// so sinks can be used inside the enumeration's no-allocation scope.
+
+// Bounded multi-producer multi-consumer queue after Dmitry Vyukov: each cell
+// carries a sequence number saying whether it is ready to be written or read
+// at the current lap, so producers and consumers only contend on their own
+// counter. capacity must be a power of two.
+template<class T>
+class bounded_queue_t
+{
+	struct cell_t
+	{
+		std::atomic<size_t> sequence;
+		T value;
+	};
+
+	std::unique_ptr<cell_t[]> cells_;
+	size_t mask_;
+	alignas(64) std::atomic<size_t> enqueue_{0};
+	alignas(64) std::atomic<size_t> dequeue_{0};
+
+public:
+	explicit bounded_queue_t(size_t capacity)
+		:
+	cells_(new cell_t[capacity]),
+	mask_(capacity - 1)
+	{
+		if (capacity == 0 || (capacity & mask_) != 0)
+		{
+			throw std::invalid_argument("bounded_queue_t: capacity must be a power of two");
+		}
+		for (size_t i = 0; i < capacity; ++i)
+		{
+			cells_[i].sequence.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	// False if the queue is full
+	bool try_push(const T& value)
+	{
+		auto position = enqueue_.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			auto& cell = cells_[position & mask_];
+			auto sequence = cell.sequence.load(std::memory_order_acquire);
+			auto difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+			if (difference == 0)
+			{
+				if (enqueue_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+				{
+					cell.value = value;
+					cell.sequence.store(position + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (difference < 0)
+			{
+				return false;
+			}
+			else
+			{
+				position = enqueue_.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// False if the queue is empty
+	bool try_pop(T& value)
+	{
+		auto position = dequeue_.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			auto& cell = cells_[position & mask_];
+			auto sequence = cell.sequence.load(std::memory_order_acquire);
+			auto difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position + 1);
+			if (difference == 0)
+			{
+				if (dequeue_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+				{
+					value = cell.value;
+					cell.sequence.store(position + mask_ + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (difference < 0)
+			{
+				return false;
+			}
+			else
+			{
+				position = dequeue_.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// Approximate number of queued values
+	size_t size() const
+	{
+		auto enqueued = enqueue_.load(std::memory_order_relaxed);
+		auto dequeued = dequeue_.load(std::memory_order_relaxed);
+		return enqueued > dequeued ? enqueued - dequeued : 0;
+	}
+};
+
+struct result_buffer_t
+{
+	std::unique_ptr<char[]> data;
+	size_t used = 0;
+};
+
+// Backpressure of a result_writer_t. Producer stalls, waiting for a free buffer,
+// mean the writer is the bottleneck; writer idle waits mean the workers are.
+struct result_writer_stats_t
+{
+	uint64_t buffers = 0;
+	uint64_t bytes = 0;
+	uint64_t producer_stalls = 0;
+	double producer_stall_seconds = 0;
+	uint64_t writer_idle_waits = 0;
+	uint64_t max_queued = 0;
+	int error = 0;
+};
+
+class result_writer_t
+{
+	int fd_;
+	bool owns_fd_;
+	size_t buffer_bytes_;
+	std::vector<result_buffer_t> buffers_;
+	bounded_queue_t<result_buffer_t*> free_;
+	bounded_queue_t<result_buffer_t*> filled_;
+	std::atomic<bool> stop_{false};
+	std::atomic<size_t> sinks_{0};
+
+	// Written by producers
+	std::atomic<uint64_t> producer_stalls_{0};
+	std::atomic<uint64_t> producer_stall_ns_{0};
+
+	// Written by the writer thread only, so plain loads and stores suffice, but
+	// atomic as stats() may read them while it runs
+	std::atomic<uint64_t> written_buffers_{0};
+	std::atomic<uint64_t> written_bytes_{0};
+	std::atomic<uint64_t> writer_idle_waits_{0};
+	std::atomic<uint64_t> max_queued_{0};
+	std::atomic<int> error_{0};
+
+	std::thread writer_;
+
+	static size_t round_up_power_of_two(size_t n)
+	{
+		size_t power = 1;
+		while (power < n)
+		{
+			power <<= 1;
+		}
+		return power;
+	}
+
+	void write_all(const char* data, size_t bytes)
+	{
+		while (bytes > 0 && error_.load(std::memory_order_relaxed) == 0)
+		{
+			auto written = ::write(fd_, data, bytes);
+			if (written < 0)
+			{
+				if (errno != EINTR)
+				{
+					error_.store(errno, std::memory_order_relaxed);
+				}
+				continue;
+			}
+			data += written;
+			bytes -= written;
+		}
+	}
+
+	// After an error buffers are still recycled, so producers never block on a
+	// dead writer; their results are dropped and stats().error says so
+	void write_loop()
+	{
+		for (;;)
+		{
+			result_buffer_t* buffer;
+			if (!filled_.try_pop(buffer))
+			{
+				if (stop_.load(std::memory_order_acquire) && filled_.size() == 0)
+				{
+					return;
+				}
+				writer_idle_waits_.store(writer_idle_waits_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+				std::this_thread::sleep_for(std::chrono::microseconds(50));
+				continue;
+			}
+			auto queued = std::max<uint64_t>(max_queued_.load(std::memory_order_relaxed), filled_.size() + 1);
+			max_queued_.store(queued, std::memory_order_relaxed);
+			write_all(buffer->data.get(), buffer->used);
+			written_buffers_.store(written_buffers_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			written_bytes_.store(written_bytes_.load(std::memory_order_relaxed) + buffer->used, std::memory_order_relaxed);
+			buffer->used = 0;
+			free_.try_push(buffer);
+		}
+	}
+
+	void start(size_t buffers)
+	{
+		for (size_t b = 0; b < buffers; ++b)
+		{
+			buffers_[b].data.reset(new char[buffer_bytes_]);
+			free_.try_push(&buffers_[b]);
+		}
+		writer_ = std::thread([this]() { write_loop(); });
+	}
+
+public:
+	// Write to fd, which stays open. buffers is rounded up to a power of two and
+	// must be at least twice the number of sinks open at once: each sink holds
+	// a partly filled buffer until it is flushed, and needs another to go on
+	// while the writer drains its last one.
+	result_writer_t(int fd, size_t buffers = 64, size_t buffer_bytes = 1 << 16)
+		:
+	fd_(fd),
+	owns_fd_(false),
+	buffer_bytes_(buffer_bytes),
+	buffers_(round_up_power_of_two(buffers)),
+	free_(buffers_.size()),
+	filled_(buffers_.size())
+	{
+		start(buffers_.size());
+	}
+
+	// Write to a new file at path, with buffers as above
+	result_writer_t(const std::string& path, size_t buffers = 64, size_t buffer_bytes = 1 << 16)
+		:
+	fd_(open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)),
+	owns_fd_(true),
+	buffer_bytes_(buffer_bytes),
+	buffers_(round_up_power_of_two(buffers)),
+	free_(buffers_.size()),
+	filled_(buffers_.size())
+	{
+		if (fd_ < 0)
+		{
+			throw std::runtime_error("cannot write results to " + path);
+		}
+		start(buffers_.size());
+	}
+
+	result_writer_t(const result_writer_t&) = delete;
+	result_writer_t& operator=(const result_writer_t&) = delete;
+
+	// Sinks must have been flushed, i.e. destroyed, before this
+	~result_writer_t()
+	{
+		close();
+		if (owns_fd_)
+		{
+			::close(fd_);
+		}
+	}
+
+	// Drain everything submitted and stop the writer thread
+	void close()
+	{
+		if (writer_.joinable())
+		{
+			stop_.store(true, std::memory_order_release);
+			writer_.join();
+		}
+	}
+
+	size_t buffer_bytes() const
+	{
+		return buffer_bytes_;
+	}
+
+	// Register a sink, throwing if the buffers could run out with every sink
+	// holding one, in which case acquire() would wait forever
+	void attach()
+	{
+		if (2 * (sinks_.fetch_add(1, std::memory_order_relaxed) + 1) > buffers_.size())
+		{
+			sinks_.fetch_sub(1, std::memory_order_relaxed);
+			throw std::logic_error("result_writer_t: fewer than two buffers per sink");
+		}
+	}
+
+	void detach()
+	{
+		sinks_.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	// An empty buffer, waiting for the writer to return one if there is none
+	result_buffer_t* acquire()
+	{
+		result_buffer_t* buffer;
+		if (free_.try_pop(buffer))
+		{
+			return buffer;
+		}
+		auto start = std::chrono::steady_clock::now();
+		while (!free_.try_pop(buffer))
+		{
+			std::this_thread::yield();
+		}
+		std::chrono::nanoseconds stalled = std::chrono::steady_clock::now() - start;
+		producer_stalls_.fetch_add(1, std::memory_order_relaxed);
+		producer_stall_ns_.fetch_add(stalled.count(), std::memory_order_relaxed);
+		return buffer;
+	}
+
+	// Hand a buffer from acquire to the writer. Never blocks: there are as many
+	// queue cells as buffers.
+	void submit(result_buffer_t* buffer)
+	{
+		filled_.try_push(buffer);
+	}
+
+	// Writer figures are only complete after close()
+	result_writer_stats_t stats() const
+	{
+		result_writer_stats_t stats;
+		stats.buffers = written_buffers_.load(std::memory_order_relaxed);
+		stats.bytes = written_bytes_.load(std::memory_order_relaxed);
+		stats.producer_stalls = producer_stalls_.load(std::memory_order_relaxed);
+		stats.producer_stall_seconds = producer_stall_ns_.load(std::memory_order_relaxed) * 1e-9;
+		stats.writer_idle_waits = writer_idle_waits_.load(std::memory_order_relaxed);
+		stats.max_queued = max_queued_.load(std::memory_order_relaxed);
+		stats.error = error_.load(std::memory_order_relaxed);
+		return stats;
+	}
+};
+
+// One worker's handle on a result_writer_t, not shared between threads. Records
+// are appended as raw bytes, so they must be trivially copyable and no larger
+// than a buffer.
+class result_sink_t
+{
+	result_writer_t& writer_;
+	result_buffer_t* buffer_ = nullptr;
+
+public:
+	explicit result_sink_t(result_writer_t& writer)
+		:
+	writer_(writer)
+	{
+		writer_.attach();
+	}
+
+	result_sink_t(const result_sink_t&) = delete;
+	result_sink_t& operator=(const result_sink_t&) = delete;
+
+	~result_sink_t()
+	{
+		flush();
+		writer_.detach();
+	}
+
+	template<class Record>
+	void push(const Record& record)
+	{
+		static_assert(std::is_trivially_copyable<Record>::value, "records are copied as bytes");
+		if (buffer_ && buffer_->used + sizeof(Record) > writer_.buffer_bytes())
+		{
+			flush();
+		}
+		if (!buffer_)
+		{
+			buffer_ = writer_.acquire();
+		}
+		std::memcpy(buffer_->data.get() + buffer_->used, &record, sizeof(Record));
+		buffer_->used += sizeof(Record);
+	}
+
+	// Hand over the partly filled buffer
+	void flush()
+	{
+		if (buffer_)
+		{
+			writer_.submit(buffer_);
+			buffer_ = nullptr;
+		}
+	}
+};
+#endif